@@ -0,0 +1,477 @@
+#pragma once
+
+#include <stdexcept>
+#include <tuple>
+
+#include "balanced_tree.h"
+
+namespace std {
+
+namespace bt_detail {
+
+/*
+ * @brief orders the pairs of a balanced_map by their keys, accepts bare keys
+ *        on either side so that lookups never build a pair
+ */
+template <typename Key, typename Value, typename Compare, bool InlineKeys>
+class map_value_compare
+    : private ebo_member<Compare, 0>
+{
+public:
+    typedef void is_transparent;
+    typedef std::pair<const Key, Value> value_type;
+
+public:
+    map_value_compare() = default;
+
+    explicit map_value_compare(const Compare& comp)
+        : ebo_member<Compare, 0>(comp)
+    {}
+
+    const Compare& key_comp() const noexcept
+    {
+        return ebo_member<Compare, 0>::get();
+    }
+
+    bool operator() (const value_type& lhs, const value_type& rhs) const
+    {
+        return key_comp()(lhs.first, rhs.first);
+    }
+
+    bool operator() (const value_type& lhs, const Key& rhs) const
+    {
+        return key_comp()(lhs.first, rhs);
+    }
+
+    bool operator() (const Key& lhs, const value_type& rhs) const
+    {
+        return key_comp()(lhs, rhs.first);
+    }
+
+    bool operator() (const Key& lhs, const Key& rhs) const
+    {
+        return key_comp()(lhs, rhs);
+    }
+
+private:
+    static const Key& key_of(const value_type& value) noexcept
+    {
+        return value.first;
+    }
+
+    static const Key& key_of(const Key& key) noexcept
+    {
+        return key;
+    }
+
+public:
+    /*
+     * @brief three-way form of the comparisons above, present when the key
+     *        comparator has one
+     */
+    template <typename L, typename R>
+    auto compare(const L& lhs, const R& rhs) const
+        -> decltype(three_way(std::declval<const Compare&>(), key_of(lhs), key_of(rhs), 0))
+    {
+        return three_way(key_comp(), key_of(lhs), key_of(rhs), 0);
+    }
+};
+
+} // namespace bt_detail
+
+/*
+ * @brief keeps a copy of the key inside the node of a balanced_map with
+ *        inline keys, descents then never touch the out-of-line pairs
+ */
+template <typename Key, typename Value, typename Compare>
+struct balanced_tree_key_cache<std::pair<const Key, Value>,
+                               bt_detail::map_value_compare<Key, Value, Compare, true> >
+{
+    typedef Key cache_type;
+    typedef std::pair<const Key, Value> value_type;
+    typedef bt_detail::map_value_compare<Key, Value, Compare, true> value_compare;
+
+    static const Key& make(const value_type& value)
+    {
+        return value.first;
+    }
+
+    template <typename K>
+    static const K& probe(const K& key)
+    {
+        return key;
+    }
+
+    template <typename K>
+    static bool less(const value_compare& comp, const cache_type& cache, const value_type&, const K& key)
+    {
+        return comp(cache, key);
+    }
+
+    template <typename K>
+    static bool greater(const value_compare& comp, const cache_type& cache, const value_type&, const K& key)
+    {
+        return comp(key, cache);
+    }
+
+    template <typename K>
+    static auto compare(const value_compare& comp, const cache_type& cache, const value_type&, const K& key)
+        -> decltype(comp.compare(cache, key))
+    {
+        return comp.compare(cache, key);
+    }
+};
+
+/*
+ * @brief ordered map on top of balanced_tree
+ *
+ * With InlineKeys every node also keeps a copy of its key next to the child
+ * pointers, so a lookup reads one cache line per level and the pairs, which
+ * may hold large values, are only touched once the key is found. The price is
+ * the memory of the extra key copy.
+ */
+template <typename Key,
+         typename Value,
+         typename Compare = std::less<Key>,
+         typename Allocator = std::allocator<std::pair<const Key, Value> >,
+         typename Balance = avl_balance,
+         bool InlineKeys = false>
+class balanced_map
+{
+public:
+    typedef Key key_type;
+    typedef Value mapped_type;
+    typedef std::pair<const Key, Value> value_type;
+    typedef size_t size_type;
+    typedef Compare key_compare;
+    typedef Allocator allocator_type;
+
+private:
+    typedef bt_detail::map_value_compare<Key, Value, Compare, InlineKeys> value_compare;
+    typedef balanced_tree<value_type, value_compare, Allocator, Balance> tree_type;
+
+public:
+    typedef typename tree_type::iterator iterator;
+    typedef typename tree_type::const_iterator const_iterator;
+    typedef typename tree_type::reverse_iterator reverse_iterator;
+    typedef typename tree_type::const_reverse_iterator const_reverse_iterator;
+
+    // @{public interfaces
+public:
+    balanced_map() = default;
+
+    explicit balanced_map(const Compare& comp, const Allocator& alloc = Allocator())
+        : m_tree(value_compare(comp), alloc)
+    {
+    }
+
+    explicit balanced_map(const Allocator& alloc)
+        : m_tree(alloc)
+    {
+    }
+
+    balanced_map(std::initializer_list<value_type> il,
+                 const Compare& comp = Compare(),
+                 const Allocator& alloc = Allocator())
+        : m_tree(il, value_compare(comp), alloc)
+    {
+    }
+
+public:
+    /*
+     * @brief returns the value mapped to key, inserts a value initialised one
+     *        when the key is missing
+     */
+    mapped_type& operator[] (const key_type& key)
+    {
+        return try_emplace(key).first->second;
+    }
+
+    mapped_type& operator[] (key_type&& key)
+    {
+        return try_emplace(std::move(key)).first->second;
+    }
+
+    /*
+     * @brief returns the value mapped to key, throws std::out_of_range when
+     *        the key is missing
+     */
+    mapped_type& at(const key_type& key)
+    {
+        auto iter = find(key);
+        if (iter == end()) {
+            throw std::out_of_range("balanced_map::at");
+        }
+        return iter->second;
+    }
+
+    const mapped_type& at(const key_type& key) const
+    {
+        auto iter = find(key);
+        if (iter == end()) {
+            throw std::out_of_range("balanced_map::at");
+        }
+        return iter->second;
+    }
+
+public:
+    /*
+     * @brief insert
+     */
+    std::pair<iterator, bool> insert(const value_type& value)
+    {
+        return m_tree.insert(value);
+    }
+
+    /*
+     * @brief insert
+     */
+    std::pair<iterator, bool> insert(value_type&& value)
+    {
+        return m_tree.insert(std::move(value));
+    }
+
+    /*
+     * @brief insert using hint as the place to start the search from
+     */
+    iterator insert(const_iterator hint, const value_type& value)
+    {
+        return m_tree.insert(hint, value);
+    }
+
+    iterator insert(const_iterator hint, value_type&& value)
+    {
+        return m_tree.insert(hint, std::move(value));
+    }
+
+    /*
+     * @brief insert
+     */
+    void insert(std::initializer_list<value_type> il)
+    {
+        m_tree.insert(il);
+    }
+
+    /*
+     * @brief constructs the mapped value from args in place, nothing is
+     *        constructed or moved from when the key is already present
+     */
+    template <typename ... Args>
+    std::pair<iterator, bool> try_emplace(const key_type& key, Args&& ... args)
+    {
+        return m_tree.emplace_unique(key, std::piecewise_construct,
+                                     std::forward_as_tuple(key),
+                                     std::forward_as_tuple(std::forward<Args>(args)...));
+    }
+
+    template <typename ... Args>
+    std::pair<iterator, bool> try_emplace(key_type&& key, Args&& ... args)
+    {
+        return m_tree.emplace_unique(key, std::piecewise_construct,
+                                     std::forward_as_tuple(std::move(key)),
+                                     std::forward_as_tuple(std::forward<Args>(args)...));
+    }
+
+    /*
+     * @brief try_emplace using hint as the place to start the search from
+     */
+    template <typename ... Args>
+    iterator try_emplace(const_iterator hint, const key_type& key, Args&& ... args)
+    {
+        return m_tree.emplace_hint_unique(hint, key, std::piecewise_construct,
+                                          std::forward_as_tuple(key),
+                                          std::forward_as_tuple(std::forward<Args>(args)...)).first;
+    }
+
+    /*
+     * @brief inserts the value or assigns it to the already mapped one
+     */
+    template <typename M>
+    std::pair<iterator, bool> insert_or_assign(const key_type& key, M&& obj)
+    {
+        auto result = try_emplace(key, std::forward<M>(obj));
+        if (!result.second) {
+            result.first->second = std::forward<M>(obj);
+        }
+        return result;
+    }
+
+    template <typename M>
+    std::pair<iterator, bool> insert_or_assign(key_type&& key, M&& obj)
+    {
+        auto result = try_emplace(std::move(key), std::forward<M>(obj));
+        if (!result.second) {
+            result.first->second = std::forward<M>(obj);
+        }
+        return result;
+    }
+
+public:
+    /*
+     * @brief removes all data from map
+     */
+    void clear()
+    {
+        m_tree.clear();
+    }
+
+    /*
+     * @brief erase element from map by position
+     */
+    iterator erase(const iterator position)
+    {
+        return m_tree.erase(position);
+    }
+
+    /*
+     * @brief erase element from map by key
+     */
+    size_type erase(const key_type& key)
+    {
+        auto iter = find(key);
+        if (iter != end()) {
+            erase(iter);
+            return 1;
+        }
+        return 0;
+    }
+
+    /*
+     * @brief exchanges the contents of two maps
+     */
+    void swap(balanced_map& that)
+    {
+        m_tree.swap(that.m_tree);
+    }
+
+public:
+    /*
+     * @brief returns true if map is empty false another case
+     */
+    bool empty() const noexcept
+    {
+        return m_tree.empty();
+    }
+
+    /*
+     * @brief returns the size of map
+     */
+    size_type size() const noexcept
+    {
+        return m_tree.size();
+    }
+
+    /*
+     * @brief returns a copy of the key comparator
+     */
+    key_compare key_comp() const
+    {
+        return m_tree.value_comp().key_comp();
+    }
+
+    /*
+     * @brief returns a copy of the allocator used by this map
+     */
+    allocator_type get_allocator() const noexcept
+    {
+        return m_tree.get_allocator();
+    }
+
+public:
+    /*
+     * @brief find element by key
+     */
+    iterator find(const key_type& key)
+    {
+        return m_tree.find(key);
+    }
+
+    const_iterator find(const key_type& key) const
+    {
+        return m_tree.find(key);
+    }
+
+    /*
+     * @brief returns 1 if key is in map, 0 another case
+     */
+    size_type count(const key_type& key) const
+    {
+        return find(key) != end() ? 1 : 0;
+    }
+
+public:
+    iterator begin()
+    {
+        return m_tree.begin();
+    }
+
+    const_iterator begin() const noexcept
+    {
+        return m_tree.begin();
+    }
+
+    iterator end()
+    {
+        return m_tree.end();
+    }
+
+    const_iterator end() const noexcept
+    {
+        return m_tree.end();
+    }
+
+    const_iterator cbegin() const noexcept
+    {
+        return m_tree.cbegin();
+    }
+
+    const_iterator cend() const noexcept
+    {
+        return m_tree.cend();
+    }
+
+    reverse_iterator rbegin()
+    {
+        return m_tree.rbegin();
+    }
+
+    const_reverse_iterator rbegin() const noexcept
+    {
+        return m_tree.rbegin();
+    }
+
+    reverse_iterator rend()
+    {
+        return m_tree.rend();
+    }
+
+    const_reverse_iterator rend() const noexcept
+    {
+        return m_tree.rend();
+    }
+    // @}
+
+private:
+    tree_type m_tree;
+};
+
+template <typename Key, typename Value, typename Compare, typename Allocator, typename Balance, bool InlineKeys>
+void swap(balanced_map<Key, Value, Compare, Allocator, Balance, InlineKeys>& lhs,
+          balanced_map<Key, Value, Compare, Allocator, Balance, InlineKeys>& rhs)
+{
+    lhs.swap(rhs);
+}
+
+#if __cplusplus >= 201703L
+namespace pmr {
+
+template <typename Key, typename Value, typename Compare = std::less<Key>,
+         typename Balance = avl_balance, bool InlineKeys = false>
+using balanced_map = std::balanced_map<Key, Value, Compare,
+                                       std::pmr::polymorphic_allocator<std::pair<const Key, Value> >,
+                                       Balance, InlineKeys>;
+
+} // namespace pmr
+#endif
+
+} // namespace std
@@ -0,0 +1,676 @@
+#pragma once
+
+#include "balanced_tree.h"
+
+namespace std {
+
+namespace bt_detail {
+
+/*
+ * @brief one node of a compressed balanced_multiset, the value and the number
+ *        of equal values it stands for
+ */
+template <typename T>
+struct counted_value
+{
+private:
+    template <typename ... Args>
+    struct is_copy
+        : std::false_type
+    {};
+
+    template <typename Arg>
+    struct is_copy<Arg>
+        : std::is_same<typename std::decay<Arg>::type, counted_value>
+    {};
+
+public:
+    // a single counted_value argument is left to the copy and move
+    // constructors, which keep the count
+    template <typename ... Args, typename = typename std::enable_if<!is_copy<Args...>::value>::type>
+    explicit counted_value(Args&& ... args)
+        : m_value(std::forward<Args>(args)...)
+        , m_count(1)
+    {}
+
+    T m_value;
+    mutable size_t m_count;
+};
+
+/*
+ * @brief orders counted values by their values, accepts bare values on either
+ *        side so that lookups never build a counted value
+ */
+template <typename T, typename Compare>
+class counted_value_compare
+    : private ebo_member<Compare, 0>
+{
+public:
+    typedef void is_transparent;
+
+public:
+    counted_value_compare() = default;
+
+    explicit counted_value_compare(const Compare& comp)
+        : ebo_member<Compare, 0>(comp)
+    {}
+
+    const Compare& value_comp() const noexcept
+    {
+        return ebo_member<Compare, 0>::get();
+    }
+
+    bool operator() (const counted_value<T>& lhs, const counted_value<T>& rhs) const
+    {
+        return value_comp()(lhs.m_value, rhs.m_value);
+    }
+
+    bool operator() (const counted_value<T>& lhs, const T& rhs) const
+    {
+        return value_comp()(lhs.m_value, rhs);
+    }
+
+    bool operator() (const T& lhs, const counted_value<T>& rhs) const
+    {
+        return value_comp()(lhs, rhs.m_value);
+    }
+};
+
+} // namespace bt_detail
+
+/*
+ * @brief ordered multiset on top of balanced_tree
+ *
+ * By default every value gets its own node and equal values are kept in
+ * insertion order. With Compressed equal values share one node carrying a
+ * count, iteration still visits each of them, which keeps heavily skewed
+ * data down to one node per distinct value.
+ */
+template <typename T,
+         typename Compare = std::less<T>,
+         typename Allocator = std::allocator<T>,
+         typename Balance = avl_balance,
+         bool Compressed = false>
+class balanced_multiset
+{
+public:
+    typedef T value_type;
+    typedef size_t size_type;
+    typedef Compare value_compare;
+    typedef Allocator allocator_type;
+
+private:
+    typedef balanced_tree<T, Compare, Allocator, Balance> tree_type;
+
+public:
+    typedef typename tree_type::const_iterator iterator;
+    typedef typename tree_type::const_iterator const_iterator;
+    typedef typename tree_type::const_reverse_iterator reverse_iterator;
+    typedef typename tree_type::const_reverse_iterator const_reverse_iterator;
+
+    // @{public interfaces
+public:
+    balanced_multiset() = default;
+
+    explicit balanced_multiset(const Compare& comp, const Allocator& alloc = Allocator())
+        : m_tree(comp, alloc)
+    {
+    }
+
+    explicit balanced_multiset(const Allocator& alloc)
+        : m_tree(alloc)
+    {
+    }
+
+    balanced_multiset(std::initializer_list<value_type> il,
+                      const Compare& comp = Compare(),
+                      const Allocator& alloc = Allocator())
+        : m_tree(comp, alloc)
+    {
+        insert(il);
+    }
+
+public:
+    /*
+     * @brief insert, always succeeds
+     */
+    iterator insert(const value_type& value)
+    {
+        return m_tree.insert_equal(value);
+    }
+
+    /*
+     * @brief insert, always succeeds
+     */
+    iterator insert(value_type&& value)
+    {
+        return m_tree.insert_equal(std::move(value));
+    }
+
+    /*
+     * @brief insert
+     */
+    void insert(std::initializer_list<value_type> il)
+    {
+        for (const auto& value : il) {
+            insert(value);
+        }
+    }
+
+public:
+    /*
+     * @brief removes all data from multiset
+     */
+    void clear()
+    {
+        m_tree.clear();
+    }
+
+    /*
+     * @brief erase one element by position
+     */
+    iterator erase(const iterator position)
+    {
+        return m_tree.erase(position);
+    }
+
+    /*
+     * @brief erase all elements equal to value, returns their number
+     */
+    size_type erase(const value_type& value)
+    {
+        auto range = equal_range(value);
+        size_type count = 0;
+        while (range.first != range.second) {
+            range.first = erase(range.first);
+            ++count;
+        }
+        return count;
+    }
+
+    /*
+     * @brief erase one element equal to value
+     */
+    bool erase_one(const value_type& value)
+    {
+        auto iter = find(value);
+        if (iter != end()) {
+            erase(iter);
+            return true;
+        }
+        return false;
+    }
+
+    /*
+     * @brief exchanges the contents of two multisets
+     */
+    void swap(balanced_multiset& that)
+    {
+        m_tree.swap(that.m_tree);
+    }
+
+public:
+    /*
+     * @brief returns true if multiset is empty false another case
+     */
+    bool empty() const noexcept
+    {
+        return m_tree.empty();
+    }
+
+    /*
+     * @brief returns the number of elements, equal ones included
+     */
+    size_type size() const noexcept
+    {
+        return m_tree.size();
+    }
+
+    value_compare value_comp() const
+    {
+        return m_tree.value_comp();
+    }
+
+    allocator_type get_allocator() const noexcept
+    {
+        return m_tree.get_allocator();
+    }
+
+public:
+    /*
+     * @brief find the first element equal to value
+     */
+    const_iterator find(const value_type& value) const
+    {
+        auto iter = lower_bound(value);
+        if (iter != end() && !m_tree.comparator()(value, *iter)) {
+            return iter;
+        }
+        return end();
+    }
+
+    /*
+     * @brief returns the number of elements equal to value
+     */
+    size_type count(const value_type& value) const
+    {
+        auto range = equal_range(value);
+        return std::distance(range.first, range.second);
+    }
+
+    const_iterator lower_bound(const value_type& value) const
+    {
+        return m_tree.lower_bound(value);
+    }
+
+    const_iterator upper_bound(const value_type& value) const
+    {
+        return m_tree.upper_bound(value);
+    }
+
+    std::pair<const_iterator, const_iterator> equal_range(const value_type& value) const
+    {
+        return std::make_pair(lower_bound(value), upper_bound(value));
+    }
+
+public:
+    const_iterator begin() const noexcept
+    {
+        return m_tree.begin();
+    }
+
+    const_iterator end() const noexcept
+    {
+        return m_tree.end();
+    }
+
+    const_iterator cbegin() const noexcept
+    {
+        return m_tree.cbegin();
+    }
+
+    const_iterator cend() const noexcept
+    {
+        return m_tree.cend();
+    }
+
+    const_reverse_iterator rbegin() const noexcept
+    {
+        return m_tree.rbegin();
+    }
+
+    const_reverse_iterator rend() const noexcept
+    {
+        return m_tree.rend();
+    }
+    // @}
+
+private:
+    tree_type m_tree;
+};
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+class balanced_multiset<T, Compare, Allocator, Balance, true>
+{
+public:
+    typedef T value_type;
+    typedef size_t size_type;
+    typedef Compare value_compare;
+    typedef Allocator allocator_type;
+
+private:
+    typedef bt_detail::counted_value<T> counted_value;
+    typedef bt_detail::counted_value_compare<T, Compare> counted_compare;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<counted_value> counted_allocator;
+    typedef balanced_tree<counted_value, counted_compare, counted_allocator, Balance> tree_type;
+    typedef typename tree_type::const_iterator node_iterator;
+
+private:
+    /*
+     * @brief walks every node as many times as its count
+     */
+    class iterator_helper
+    {
+        friend balanced_multiset;
+    public:
+        typedef std::ptrdiff_t difference_type;
+        typedef T value_type;
+        typedef const T* pointer;
+        typedef const T& reference;
+        typedef std::bidirectional_iterator_tag iterator_category;
+
+    public:
+        iterator_helper()
+            : m_index(0)
+        {}
+
+    private:
+        iterator_helper(node_iterator node, size_type index)
+            : m_node(node)
+            , m_index(index)
+        {}
+
+    public:
+        reference operator* () const
+        {
+            return m_node->m_value;
+        }
+
+        pointer operator-> () const
+        {
+            return &m_node->m_value;
+        }
+
+        iterator_helper& operator++ ()
+        {
+            if (++m_index == m_node->m_count) {
+                ++m_node;
+                m_index = 0;
+            }
+            return *this;
+        }
+
+        iterator_helper operator++ (int)
+        {
+            iterator_helper tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+
+        iterator_helper& operator-- ()
+        {
+            if (m_index == 0) {
+                --m_node;
+                m_index = m_node->m_count;
+            }
+            --m_index;
+            return *this;
+        }
+
+        iterator_helper operator-- (int)
+        {
+            iterator_helper tmp = *this;
+            --(*this);
+            return tmp;
+        }
+
+        bool operator== (const iterator_helper& that) const
+        {
+            return m_node == that.m_node && m_index == that.m_index;
+        }
+
+        bool operator!= (const iterator_helper& that) const
+        {
+            return !(*this == that);
+        }
+
+    private:
+        node_iterator m_node;
+        size_type m_index;
+    };
+
+public:
+    typedef iterator_helper iterator;
+    typedef iterator_helper const_iterator;
+
+    // @{public interfaces
+public:
+    balanced_multiset()
+        : m_size(0)
+    {
+    }
+
+    explicit balanced_multiset(const Compare& comp, const Allocator& alloc = Allocator())
+        : m_tree(counted_compare(comp), counted_allocator(alloc))
+        , m_size(0)
+    {
+    }
+
+    explicit balanced_multiset(const Allocator& alloc)
+        : m_tree(counted_allocator(alloc))
+        , m_size(0)
+    {
+    }
+
+    balanced_multiset(std::initializer_list<value_type> il,
+                      const Compare& comp = Compare(),
+                      const Allocator& alloc = Allocator())
+        : m_tree(counted_compare(comp), counted_allocator(alloc))
+        , m_size(0)
+    {
+        insert(il);
+    }
+
+    balanced_multiset(const balanced_multiset&) = default;
+    balanced_multiset& operator= (const balanced_multiset&) = default;
+
+    balanced_multiset(balanced_multiset&& that)
+        : m_tree(std::move(that.m_tree))
+        , m_size(that.m_size)
+    {
+        that.m_size = 0;
+    }
+
+    balanced_multiset& operator= (balanced_multiset&& that)
+    {
+        if (&that != this) {
+            m_tree = std::move(that.m_tree);
+            m_size = that.m_size;
+            that.m_size = 0;
+        }
+        return *this;
+    }
+
+public:
+    /*
+     * @brief insert, always succeeds, an equal value already in the multiset
+     *        only gets its count incremented
+     */
+    iterator insert(const value_type& value)
+    {
+        auto result = m_tree.emplace_unique(value, value);
+        ++m_size;
+        if (result.second) {
+            return iterator(result.first, 0);
+        }
+        return iterator(result.first, result.first->m_count++);
+    }
+
+    /*
+     * @brief insert, always succeeds
+     */
+    iterator insert(value_type&& value)
+    {
+        auto result = m_tree.emplace_unique(value, std::move(value));
+        ++m_size;
+        if (result.second) {
+            return iterator(result.first, 0);
+        }
+        return iterator(result.first, result.first->m_count++);
+    }
+
+    /*
+     * @brief insert
+     */
+    void insert(std::initializer_list<value_type> il)
+    {
+        for (const auto& value : il) {
+            insert(value);
+        }
+    }
+
+public:
+    /*
+     * @brief removes all data from multiset
+     */
+    void clear()
+    {
+        m_tree.clear();
+        m_size = 0;
+    }
+
+    /*
+     * @brief erase one element by position
+     */
+    iterator erase(const iterator position)
+    {
+        auto node = position.m_node;
+        --m_size;
+        if (--node->m_count != 0) {
+            // the position now holds the next equal element, if there is one
+            return position.m_index < node->m_count ? position : iterator(++node, 0);
+        }
+        return iterator(m_tree.erase(node), 0);
+    }
+
+    /*
+     * @brief erase all elements equal to value, returns their number
+     */
+    size_type erase(const value_type& value)
+    {
+        auto node = m_tree.find(value);
+        if (node == m_tree.end()) {
+            return 0;
+        }
+        const auto count = node->m_count;
+        m_tree.erase(node);
+        m_size -= count;
+        return count;
+    }
+
+    /*
+     * @brief erase one element equal to value
+     */
+    bool erase_one(const value_type& value)
+    {
+        auto iter = find(value);
+        if (iter != end()) {
+            erase(iter);
+            return true;
+        }
+        return false;
+    }
+
+    /*
+     * @brief exchanges the contents of two multisets
+     */
+    void swap(balanced_multiset& that)
+    {
+        m_tree.swap(that.m_tree);
+        std::swap(m_size, that.m_size);
+    }
+
+public:
+    /*
+     * @brief returns true if multiset is empty false another case
+     */
+    bool empty() const noexcept
+    {
+        return m_tree.empty();
+    }
+
+    /*
+     * @brief returns the number of elements, equal ones included
+     */
+    size_type size() const noexcept
+    {
+        return m_size;
+    }
+
+    /*
+     * @brief returns the number of distinct elements, that is of nodes
+     */
+    size_type distinct_size() const noexcept
+    {
+        return m_tree.size();
+    }
+
+    value_compare value_comp() const
+    {
+        return m_tree.value_comp().value_comp();
+    }
+
+    allocator_type get_allocator() const noexcept
+    {
+        return allocator_type(m_tree.get_allocator());
+    }
+
+public:
+    /*
+     * @brief find the first element equal to value
+     */
+    const_iterator find(const value_type& value) const
+    {
+        return const_iterator(m_tree.find(value), 0);
+    }
+
+    /*
+     * @brief returns the number of elements equal to value
+     */
+    size_type count(const value_type& value) const
+    {
+        auto node = m_tree.find(value);
+        return node != m_tree.end() ? node->m_count : 0;
+    }
+
+    const_iterator lower_bound(const value_type& value) const
+    {
+        return const_iterator(m_tree.lower_bound(value), 0);
+    }
+
+    const_iterator upper_bound(const value_type& value) const
+    {
+        return const_iterator(m_tree.upper_bound(value), 0);
+    }
+
+    std::pair<const_iterator, const_iterator> equal_range(const value_type& value) const
+    {
+        return std::make_pair(lower_bound(value), upper_bound(value));
+    }
+
+public:
+    const_iterator begin() const noexcept
+    {
+        return const_iterator(m_tree.begin(), 0);
+    }
+
+    const_iterator end() const noexcept
+    {
+        return const_iterator(m_tree.end(), 0);
+    }
+
+    const_iterator cbegin() const noexcept
+    {
+        return begin();
+    }
+
+    const_iterator cend() const noexcept
+    {
+        return end();
+    }
+    // @}
+
+private:
+    tree_type m_tree;
+    size_type m_size;
+};
+
+template <typename T, typename Compare, typename Allocator, typename Balance, bool Compressed>
+void swap(balanced_multiset<T, Compare, Allocator, Balance, Compressed>& lhs,
+          balanced_multiset<T, Compare, Allocator, Balance, Compressed>& rhs)
+{
+    lhs.swap(rhs);
+}
+
+#if __cplusplus >= 201703L
+namespace pmr {
+
+template <typename T, typename Compare = std::less<T>,
+         typename Balance = avl_balance, bool Compressed = false>
+using balanced_multiset = std::balanced_multiset<T, Compare, std::pmr::polymorphic_allocator<T>,
+                                                 Balance, Compressed>;
+
+} // namespace pmr
+#endif
+
+} // namespace std
@@ -1,46 +1,599 @@
 #pragma once
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
 #include <functional>
+#include <future>
 #include <initializer_list>
 #include <iterator>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if __cplusplus >= 201703L
+#include <memory_resource>
+#endif
+
+#if __cplusplus > 201703L
+#include <compare>
+#endif
+
+#ifdef __linux__
+#include <cstdlib>
+#include <sys/mman.h>
+#endif
 
 namespace std {
 
+namespace bt_detail {
+
+/*
+ * @brief std::is_final, which C++11 lacks, through the compiler builtin
+ *        behind it
+ */
+template <typename T>
+struct is_final
+#if __cplusplus >= 201402L
+    : std::is_final<T>
+#else
+    : std::integral_constant<bool, __is_final(T)>
+#endif
+{};
+
+/*
+ * @brief holds a comparator or an allocator, taking no space when it is
+ *        stateless (empty base optimisation)
+ */
+template <typename T, int Index,
+         bool Empty = std::is_empty<T>::value && !is_final<T>::value>
+class ebo_member
+    : private T
+{
+public:
+    ebo_member() = default;
+
+    explicit ebo_member(const T& value)
+        : T(value)
+    {}
+
+    explicit ebo_member(T&& value)
+        : T(std::move(value))
+    {}
+
+    T& get() noexcept
+    {
+        return *this;
+    }
+
+    const T& get() const noexcept
+    {
+        return *this;
+    }
+};
+
+template <typename T, int Index>
+class ebo_member<T, Index, false>
+{
+public:
+    ebo_member() = default;
+
+    explicit ebo_member(const T& value)
+        : m_member(value)
+    {}
+
+    explicit ebo_member(T&& value)
+        : m_member(std::move(value))
+    {}
+
+    T& get() noexcept
+    {
+        return m_member;
+    }
+
+    const T& get() const noexcept
+    {
+        return m_member;
+    }
+
+private:
+    T m_member;
+};
+
+/*
+ * @brief stable sort splitting the range onto threads above a size cutoff,
+ *        the sorted halves are merged back in place
+ */
+template <typename RandomIt, typename Less>
+void parallel_stable_sort(RandomIt first, RandomIt last, Less less, unsigned threads)
+{
+    const size_t cutoff = 1 << 15;
+    if (threads < 2 || static_cast<size_t>(last - first) < cutoff) {
+        std::stable_sort(first, last, less);
+        return;
+    }
+    auto middle = first + (last - first) / 2;
+    std::future<void> left;
+    try {
+        left = std::async(std::launch::async, [=] {
+            parallel_stable_sort(first, middle, less, threads / 2);
+        });
+    } catch (...) {
+    }
+    if (!left.valid()) {
+        std::stable_sort(first, last, less);
+        return;
+    }
+    try {
+        parallel_stable_sort(middle, last, less, threads - threads / 2);
+    } catch (...) {
+        left.wait();
+        throw;
+    }
+    left.get();
+    std::inplace_merge(first, middle, last, less);
+}
+
+/*
+ * @brief three-way comparison through comp, negative, zero or positive as lhs
+ *        orders before, with or after rhs
+ *
+ * Available for comparators with a compare(lhs, rhs) member returning an int
+ * and, since C++20, for std::less over types whose operator<=> is a weak or
+ * strong ordering.
+ */
+template <typename Compare, typename L, typename R>
+auto three_way(const Compare& comp, const L& lhs, const R& rhs, int)
+    -> decltype(static_cast<int>(comp.compare(lhs, rhs)))
+{
+    return comp.compare(lhs, rhs);
+}
+
+#if __cplusplus > 201703L
+template <typename T, typename L, typename R>
+auto three_way(const std::less<T>&, const L& lhs, const R& rhs, long)
+    -> std::enable_if_t<std::is_convertible_v<decltype(lhs <=> rhs), std::weak_ordering>, int>
+{
+    const std::weak_ordering order = lhs <=> rhs;
+    return order < 0 ? -1 : (order > 0 ? 1 : 0);
+}
+#endif
+
+/*
+ * @brief background thread running the tasks posted to it in order, the
+ *        pending ones are finished before the program exits
+ */
+class reclaimer
+{
+public:
+    static reclaimer& instance()
+    {
+        static reclaimer background;
+        return background;
+    }
+
+    void post(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tasks.push_back(std::move(task));
+        }
+        m_ready.notify_one();
+    }
+
+    ~reclaimer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_ready.notify_one();
+        m_thread.join();
+    }
+
+private:
+    reclaimer()
+        : m_stop(false)
+        , m_thread(&reclaimer::run, this)
+    {}
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;) {
+            m_ready.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+            if (m_tasks.empty()) {
+                return;
+            }
+            auto task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    std::deque<std::function<void()> > m_tasks;
+    bool m_stop;
+    // started last, once the members it uses are constructed
+    std::thread m_thread;
+};
+
+/*
+ * @brief allocates bytes on 2MB boundaries and asks the kernel to back them
+ *        with huge pages, returns nullptr where that is not supported
+ */
+inline void* huge_page_allocate(size_t bytes)
+{
+#ifdef __linux__
+    const size_t page = size_t(2) << 20;
+    bytes = (bytes + page - 1) / page * page;
+    void* memory = nullptr;
+    if (posix_memalign(&memory, page, bytes) != 0) {
+        return nullptr;
+    }
+    madvise(memory, bytes, MADV_HUGEPAGE);
+    return memory;
+#else
+    (void)bytes;
+    return nullptr;
+#endif
+}
+
+inline void huge_page_deallocate(void* memory)
+{
+#ifdef __linux__
+    free(memory);
+#else
+    (void)memory;
+#endif
+}
+
+} // namespace bt_detail
+
+/*
+ * @brief tells whether an allocator may be used from several threads at
+ *        once, which lets balanced_tree copy and free large trees in parallel
+ *
+ * Specialise it as std::true_type for other thread-safe allocators.
+ */
+template <typename Allocator>
+struct balanced_tree_thread_safe_allocator
+    : std::false_type
+{};
+
+template <typename T>
+struct balanced_tree_thread_safe_allocator<std::allocator<T> >
+    : std::true_type
+{};
+
+/*
+ * @brief per-node key cache hook of balanced_tree
+ *
+ * Searches compare the probed key against a node through this hook. The
+ * default keeps nothing in the node and compares the stored values. A
+ * specialisation may keep a copy (or a part) of the key inside the node so
+ * that descents are resolved from the node's own cache line, without
+ * following m_value to the out-of-line value.
+ *
+ * A search turns its key into a probe once, and the probe is what less and
+ * greater receive, so the work of deriving the key's cached form is not
+ * repeated on every level. A hook may also provide compare, a three-way
+ * form of less and greater; exact lookups then cost one call per node.
+ */
+template <typename T, typename Compare>
+struct balanced_tree_key_cache
+{
+    struct cache_type {};
+
+    static cache_type make(const T&)
+    {
+        return cache_type();
+    }
+
+    /*
+     * @brief returns the form of key handed to less and greater
+     */
+    template <typename K>
+    static const K& probe(const K& key)
+    {
+        return key;
+    }
+
+    /*
+     * @brief returns true if the node value orders before the key
+     */
+    template <typename K>
+    static bool less(const Compare& comp, const cache_type&, const T& value, const K& key)
+    {
+        return comp(value, key);
+    }
+
+    /*
+     * @brief returns true if the node value orders after the key
+     */
+    template <typename K>
+    static bool greater(const Compare& comp, const cache_type&, const T& value, const K& key)
+    {
+        return comp(key, value);
+    }
+
+    /*
+     * @brief orders the node value against the key in a single call, only
+     *        present when Compare has a three-way form
+     */
+    template <typename K>
+    static auto compare(const Compare& comp, const cache_type&, const T& value, const K& key)
+        -> decltype(bt_detail::three_way(comp, value, key, 0))
+    {
+        return bt_detail::three_way(comp, value, key, 0);
+    }
+};
+
+/*
+ * @brief keeps the first 8 bytes of a string key inside the node
+ *
+ * The bytes are packed big-endian into an integer, zero padded, so that the
+ * integers order like the strings they are taken from. Only on a prefix tie
+ * is the full string compared, which needs the value and its heap buffer.
+ */
+template <>
+struct balanced_tree_key_cache<std::string, std::less<std::string> >
+{
+    typedef std::uint64_t cache_type;
+
+    struct probe_type
+    {
+        cache_type m_prefix;
+        const std::string& m_key;
+    };
+
+    static cache_type make(const std::string& value) noexcept
+    {
+        unsigned char bytes[sizeof(cache_type)] = {};
+        std::memcpy(bytes, value.data(), std::min(value.size(), sizeof(cache_type)));
+        cache_type prefix = 0;
+        for (auto byte : bytes) {
+            prefix = (prefix << 8) | byte;
+        }
+        return prefix;
+    }
+
+    static probe_type probe(const std::string& key) noexcept
+    {
+        return probe_type{make(key), key};
+    }
+
+    static bool less(const std::less<std::string>& comp, cache_type cache,
+                     const std::string& value, const probe_type& key)
+    {
+        return cache != key.m_prefix ? cache < key.m_prefix : comp(value, key.m_key);
+    }
+
+    static bool greater(const std::less<std::string>& comp, cache_type cache,
+                        const std::string& value, const probe_type& key)
+    {
+        return cache != key.m_prefix ? cache > key.m_prefix : comp(key.m_key, value);
+    }
+
+    static int compare(const std::less<std::string>&, cache_type cache,
+                       const std::string& value, const probe_type& key)
+    {
+        return cache != key.m_prefix ? (cache < key.m_prefix ? -1 : 1) : value.compare(key.m_key);
+    }
+};
+
+/*
+ * @brief balancing policies for balanced_tree
+ *
+ * avl_balance keeps the subtree height in every node and gives the shallowest
+ * trees, red_black_balance keeps a color bit and does at most two rotations
+ * per insert and three per erase, weight_balance keeps the subtree size and
+ * gives order statistics for free.
+ */
+struct avl_balance
+{
+    typedef int node_data;
+};
+
+struct red_black_balance
+{
+    typedef bool node_data;
+};
+
+struct weight_balance
+{
+    typedef size_t node_data;
+};
+
+/*
+ * @brief node orders for balanced_tree::relayout
+ *
+ * breadth_first and van_emde_boas keep the top levels of the tree, which
+ * every lookup passes, on a few pages; van_emde_boas also keeps each short
+ * run of a root-to-leaf path close at every scale. in_order suits scans.
+ */
+enum class balanced_tree_layout
+{
+    in_order,
+    breadth_first,
+    van_emde_boas
+};
+
+/*
+ * @brief subtree augmentation policy of balanced_tree, the default keeps
+ *        nothing and costs nothing
+ *
+ * An augmentation is a monoid over the values: every node keeps the
+ * combination, in order, of the values of its subtree, which lets range
+ * aggregates combine O(log n) summaries instead of visiting every element.
+ * A policy provides
+ *
+ *     typedef ... summary_type;
+ *     static summary_type identity();
+ *     static summary_type make(const T& value);
+ *     static summary_type combine(const summary_type& lhs, const summary_type& rhs);
+ *
+ * where combine is associative with identity as its neutral element. The
+ * summary must only depend on what the tree does not let change in place.
+ */
+struct no_augment
+{
+    struct summary_type {};
+};
+
+/*
+ * @brief augmentation counting the elements of every subtree, it gives
+ *        balanced_tree::partition exact sizes under any balancing policy
+ *
+ * Any augmentation with a static size(const summary_type&) returning the
+ * number of elements is used the same way.
+ */
+struct size_augment
+{
+    typedef size_t summary_type;
+
+    static size_t identity()
+    {
+        return 0;
+    }
+
+    template <typename T>
+    static size_t make(const T&)
+    {
+        return 1;
+    }
+
+    static size_t combine(size_t lhs, size_t rhs)
+    {
+        return lhs + rhs;
+    }
+
+    static size_t size(size_t summary)
+    {
+        return summary;
+    }
+};
+
 template <typename T,
          typename Compare = std::less<T>,
-         typename Allocator = std::allocator<T> >
+         typename Allocator = std::allocator<T>,
+         typename Balance = avl_balance,
+         typename Augment = no_augment>
 class balanced_tree
+    : private bt_detail::ebo_member<Compare, 0>
+    , private bt_detail::ebo_member<Allocator, 1>
 {
+    template <typename, typename, typename, typename, typename, bool>
+    friend class balanced_map;
+    template <typename, typename, typename, typename, bool>
+    friend class balanced_multiset;
+
 private:
     using value_type = T;
     using size_type = size_t;
 
+public:
+    typedef Compare value_compare;
+    typedef Allocator allocator_type;
+    typedef Balance balance_policy;
+    typedef Augment augment_policy;
+    typedef typename Augment::summary_type summary_type;
+
 private:
+    typedef bt_detail::ebo_member<Compare, 0> compare_holder;
+    typedef bt_detail::ebo_member<Allocator, 1> allocator_holder;
+    typedef std::allocator_traits<Allocator> allocator_traits;
+    typedef typename Balance::node_data balance_data;
+    typedef balanced_tree_key_cache<T, Compare> key_cache;
+    typedef typename key_cache::cache_type key_cache_type;
+    typedef typename Augment::summary_type summary_data;
+    typedef std::is_same<Augment, no_augment> unaugmented;
+
     struct bt_node
+        : bt_detail::ebo_member<key_cache_type, 2>
+        , bt_detail::ebo_member<summary_data, 3>
     {
         value_type* m_value;
         bt_node* m_left_child;
         bt_node* m_right_child;
         bt_node* m_parent;
-        size_type m_height;
-
-        template <typename ... Args>
-        explicit bt_node(Args&& ... args)
-            : m_value(s_allocator.allocate(1))
+        balance_data m_balance;
+        bool m_tombstone;
+        // set for nodes and values placed in a slab by relayout, their
+        // memory is released with the slab
+        bool m_slab_node;
+        bool m_slab_value;
+
+        explicit bt_node(value_type* value)
+            : bt_detail::ebo_member<key_cache_type, 2>(key_cache::make(*value))
+            , bt_detail::ebo_member<summary_data, 3>()
+            , m_value(value)
             , m_left_child(nullptr)
             , m_right_child(nullptr)
             , m_parent(nullptr)
-            , m_height(0)
+            , m_balance()
+            , m_tombstone(false)
+            , m_slab_node(false)
+            , m_slab_value(false)
+        {
+        }
+
+        const key_cache_type& cache() const noexcept
         {
-            s_allocator.construct(m_value, std::forward<Args>(args)...);
+            return bt_detail::ebo_member<key_cache_type, 2>::get();
         }
 
-        ~bt_node()
+        summary_data& summary() noexcept
         {
-            s_allocator.destroy(m_value);
-            s_allocator.deallocate(m_value, 1);
+            return bt_detail::ebo_member<summary_data, 3>::get();
         }
+
+        const summary_data& summary() const noexcept
+        {
+            return bt_detail::ebo_member<summary_data, 3>::get();
+        }
+    };
+
+    typedef typename allocator_traits::template rebind_alloc<bt_node> node_allocator;
+    typedef std::allocator_traits<node_allocator> node_allocator_traits;
+
+    struct slab_entry
+    {
+        alignas(bt_node) unsigned char m_node[sizeof(bt_node)];
+        alignas(value_type) unsigned char m_value[sizeof(value_type)];
+    };
+
+    typedef typename allocator_traits::template rebind_alloc<slab_entry> slab_allocator;
+    typedef std::allocator_traits<slab_allocator> slab_allocator_traits;
+
+    struct slab
+    {
+        slab_entry* m_entries;
+        size_type m_count;
+        bool m_huge_pages;
+    };
+
+    struct lazy_erase_state
+    {
+        lazy_erase_state()
+            : m_enabled(false)
+            , m_compact_ratio(0.5)
+            , m_tombstones(0)
+        {}
+
+        bool m_enabled;
+        double m_compact_ratio;
+        size_type m_tombstones;
     };
 
 private:
@@ -48,6 +601,12 @@ private:
     class iterator_helper
     {
         friend balanced_tree;
+        template <typename, typename, typename>
+        friend class iterator_helper;
+
+        template <typename IterT>
+        using enable_if_convertible = typename std::enable_if<
+            std::is_convertible<decltype(std::declval<const IterT&>().m_data), DataType>::value>::type;
     public:
         typedef std::ptrdiff_t difference_type;
         typedef balanced_tree::value_type value_type;
@@ -70,7 +629,7 @@ private:
             that.m_data = nullptr;
         }
 
-        template <typename IterT>
+        template <typename IterT, typename = enable_if_convertible<IterT> >
         iterator_helper(const IterT& that)
             : m_data(that.m_data)
         {}
@@ -99,12 +658,10 @@ private:
             return *this;
         }
 
-        template <typename IterT>
+        template <typename IterT, typename = enable_if_convertible<IterT> >
         iterator_helper& operator= (const IterT& that)
         {
-            if (&that != this) {
-                m_data = that.m_data;
-            }
+            m_data = that.m_data;
             return *this;
         }
 
@@ -117,26 +674,26 @@ private:
 
         iterator_helper& operator++ ()
         {
-            m_data = balanced_tree::successor(m_data);
+            m_data = balanced_tree::skip_forward(balanced_tree::successor(m_data));
             return *this;
         }
 
-        bool operator== (const iterator_helper& that)
+        bool operator== (const iterator_helper& that) const
         {
-            return m_data = that.m_data;
+            return m_data == that.m_data;
         }
 
-        bool operator!= (const iterator_helper& that)
+        bool operator!= (const iterator_helper& that) const
         {
             return m_data != that.m_data;
         }
 
-        reference operator-> ()
+        pointer operator-> () const
         {
-            return *m_data->m_value;
+            return m_data->m_value;
         }
 
-        const iterator_helper operator++ (int) const
+        iterator_helper operator++ (int)
         {
             iterator_helper tmp = *this;
             ++(*this);
@@ -145,11 +702,11 @@ private:
 
         iterator_helper& operator-- ()
         {
-            m_data = balanced_tree::predecessor(m_data);
+            m_data = balanced_tree::skip_backward(balanced_tree::predecessor(m_data));
             return *this;
         }
 
-        iterator_helper operator-- (int) const
+        iterator_helper operator-- (int)
         {
             iterator_helper tmp = *this;
             --(*this);
@@ -164,6 +721,12 @@ private:
     class reverse_iterator_helper
     {
         friend balanced_tree;
+        template <typename, typename, typename>
+        friend class reverse_iterator_helper;
+
+        template <typename IterT>
+        using enable_if_convertible = typename std::enable_if<
+            std::is_convertible<decltype(std::declval<const IterT&>().m_data), DataType>::value>::type;
     public:
         typedef std::ptrdiff_t difference_type;
         typedef balanced_tree::value_type value_type;
@@ -186,7 +749,7 @@ private:
             that.m_data = nullptr;
         }
 
-        template <typename IterT>
+        template <typename IterT, typename = enable_if_convertible<IterT> >
         reverse_iterator_helper(const IterT& that)
             : m_data(that.m_data)
         {}
@@ -215,12 +778,10 @@ private:
             return *this;
         }
 
-        template <typename IterT>
+        template <typename IterT, typename = enable_if_convertible<IterT> >
         reverse_iterator_helper& operator= (const IterT& that)
         {
-            if (&that != this) {
-                m_data = that.m_data;
-            }
+            m_data = that.m_data;
             return *this;
         }
 
@@ -233,26 +794,26 @@ private:
 
         reverse_iterator_helper& operator++ ()
         {
-            m_data = balanced_tree::predecessor(m_data);
+            m_data = balanced_tree::skip_backward(balanced_tree::predecessor(m_data));
             return *this;
         }
 
-        bool operator== (const reverse_iterator_helper& that)
+        bool operator== (const reverse_iterator_helper& that) const
         {
-            return m_data = that.m_data;
+            return m_data == that.m_data;
         }
 
-        bool operator!= (const reverse_iterator_helper& that)
+        bool operator!= (const reverse_iterator_helper& that) const
         {
             return m_data != that.m_data;
         }
 
-        reference operator-> ()
+        pointer operator-> () const
         {
-            return *m_data->m_value;
+            return m_data->m_value;
         }
 
-        const reverse_iterator_helper operator++ (int) const
+        reverse_iterator_helper operator++ (int)
         {
             reverse_iterator_helper tmp = *this;
             ++(*this);
@@ -261,11 +822,11 @@ private:
 
         reverse_iterator_helper& operator-- ()
         {
-            m_data = balanced_tree::successor(m_data);
+            m_data = balanced_tree::skip_forward(balanced_tree::successor(m_data));
             return *this;
         }
 
-        reverse_iterator_helper operator-- (int) const
+        reverse_iterator_helper operator-- (int)
         {
             reverse_iterator_helper tmp = *this;
             --(*this);
@@ -288,47 +849,130 @@ public:
     balanced_tree()
         : m_head(nullptr)
         , m_size(0)
+        , m_max(nullptr)
     {
     }
 
-    balanced_tree(std::initializer_list<value_type> il)
-        : m_head(nullptr)
+    explicit balanced_tree(const Compare& comp, const Allocator& alloc = Allocator())
+        : compare_holder(comp)
+        , allocator_holder(alloc)
+        , m_head(nullptr)
+        , m_size(0)
+        , m_max(nullptr)
+    {
+    }
+
+    explicit balanced_tree(const Allocator& alloc)
+        : allocator_holder(alloc)
+        , m_head(nullptr)
+        , m_size(0)
+        , m_max(nullptr)
+    {
+    }
+
+    balanced_tree(std::initializer_list<value_type> il,
+                  const Compare& comp = Compare(),
+                  const Allocator& alloc = Allocator())
+        : compare_holder(comp)
+        , allocator_holder(alloc)
+        , m_head(nullptr)
+        , m_size(0)
+        , m_max(nullptr)
+    {
+        insert(il);
+    }
+
+    template <typename InputIt,
+             typename = typename std::iterator_traits<InputIt>::iterator_category>
+    balanced_tree(InputIt first, InputIt last,
+                  const Compare& comp = Compare(),
+                  const Allocator& alloc = Allocator())
+        : compare_holder(comp)
+        , allocator_holder(alloc)
+        , m_head(nullptr)
+        , m_size(0)
+        , m_max(nullptr)
+    {
+        insert(first, last);
+    }
+
+    balanced_tree(std::initializer_list<value_type> il, const Allocator& alloc)
+        : allocator_holder(alloc)
+        , m_head(nullptr)
         , m_size(0)
+        , m_max(nullptr)
     {
         insert(il);
     }
 
     balanced_tree(const balanced_tree& that)
-        : m_head(nullptr)
-        , m_size(that.m_size)
+        : compare_holder(that.value_comp())
+        , allocator_holder(allocator_traits::select_on_container_copy_construction(that.get_allocator()))
+        , m_head(nullptr)
+        , m_size(0)
+        , m_max(nullptr)
+    {
+        copy_from(that);
+    }
+
+    balanced_tree(const balanced_tree& that, const Allocator& alloc)
+        : compare_holder(that.value_comp())
+        , allocator_holder(alloc)
+        , m_head(nullptr)
+        , m_size(0)
+        , m_max(nullptr)
     {
-        balanced_tree::copy(that.m_head, m_head, nullptr);
+        copy_from(that);
     }
 
     balanced_tree& operator= (const balanced_tree& that)
     {
         if (&that != this) {
-            balanced_tree::copy(that.m_head, m_head, nullptr);
-            m_size = that.m_size;
+            clear();
+            copy_allocator(that, typename allocator_traits::propagate_on_container_copy_assignment());
+            comparator() = that.comparator();
+            copy_from(that);
         }
         return *this;
     }
 
     balanced_tree(balanced_tree&& that)
-        : m_head(that.m_head)
+        : compare_holder(std::move(that.comparator()))
+        , allocator_holder(std::move(that.allocator()))
+        , m_head(that.m_head)
         , m_size(that.m_size)
+        , m_max(that.m_max)
+        , m_lazy(that.m_lazy)
+        , m_slabs(std::move(that.m_slabs))
     {
+        that.m_slabs.clear();
         that.m_head = nullptr;
         that.m_size = 0;
+        that.m_max = nullptr;
+        that.m_lazy.m_tombstones = 0;
+    }
+
+    balanced_tree(balanced_tree&& that, const Allocator& alloc)
+        : compare_holder(that.value_comp())
+        , allocator_holder(alloc)
+        , m_head(nullptr)
+        , m_size(0)
+        , m_max(nullptr)
+    {
+        if (alloc == that.get_allocator()) {
+            steal(that);
+        } else {
+            move_from(that);
+        }
     }
 
     balanced_tree& operator= (balanced_tree&& that)
     {
         if (&that != this) {
-            m_head = that.m_head;
-            m_size = that.m_size;
-            that.m_head = nullptr;
-            that.m_size = 0;
+            clear();
+            move_assign(that, std::integral_constant<bool,
+                        allocator_traits::propagate_on_container_move_assignment::value ||
+                        allocator_traits::is_always_equal::value>());
         }
         return *this;
     }
@@ -340,91 +984,247 @@ public:
 
 public:
     /*
-     * @brief insert
+     * @brief exchanges the contents of two trees, the allocators are swapped
+     *        only when the allocator asks for it, otherwise they must compare equal
      */
-    std::pair<iterator, bool> insert(const value_type& value)
+    void swap(balanced_tree& that)
     {
-        auto result = balanced_tree::insert(value, this, nullptr, m_head);
-        if (result.second) {
-            ++m_size;
+        if (&that == this) {
+            return;
         }
-        return result;
+        swap_allocator(that, typename allocator_traits::propagate_on_container_swap());
+        std::swap(comparator(), that.comparator());
+        std::swap(m_head, that.m_head);
+        std::swap(m_size, that.m_size);
+        std::swap(m_max, that.m_max);
+        std::swap(m_lazy, that.m_lazy);
+        m_slabs.swap(that.m_slabs);
+#ifdef BALANCED_TREE_STATS
+        std::swap(m_rotations, that.m_rotations);
+#endif
     }
 
     /*
-     * @brief insert
+     * @brief returns a copy of the allocator used by this tree
      */
-    std::pair<iterator, bool> insert(value_type&& value)
+    allocator_type get_allocator() const noexcept
     {
-        value_type tmp(value);
-        return insert(tmp);
+        return allocator();
     }
 
     /*
-     * @brief insert
+     * @brief returns a copy of the comparator used by this tree
      */
-    void insert(std::initializer_list<value_type> il)
+    value_compare value_comp() const
     {
-        for (const auto& value : il) {
-            insert(value);
-        }
+        return comparator();
     }
 
 public:
     /*
-     * @brief removes all data from tree
+     * @brief insert
      */
-    void clear()
+    std::pair<iterator, bool> insert(const value_type& value)
     {
-        balanced_tree::destroy(m_head);
-        m_size = 0;
-        m_head = nullptr;
+        return insert_unique(value);
     }
 
     /*
-     * @brief erase element from tree by position
+     * @brief insert
      */
-    iterator erase(const iterator position)
+    std::pair<iterator, bool> insert(value_type&& value)
     {
-        iterator new_position(position);
-        ++new_position;
-        balanced_tree::destroy_one(position.m_data);
-        --m_size;
-        return new_position;
+        return insert_unique(std::move(value));
     }
 
     /*
-     * @brief erase element from tree by position
+     * @brief insert using hint as the place to start the search from
+     *
+     * The search first checks whether value belongs right next to hint and
+     * otherwise climbs from hint only as far as needed (finger search), so
+     * nearly sorted input costs comparisons in the distance to hint rather
+     * than in the tree size. Use end() as hint to append.
      */
-    reverse_iterator erase(const reverse_iterator position)
+    iterator insert(const_iterator hint, const value_type& value)
     {
-        reverse_iterator new_position(position);
-        ++new_position;
-        balanced_tree::destroy_one(position.m_data);
-        --m_size;
-        return new_position;
+        return emplace_hint_unique(hint, value, value).first;
     }
 
     /*
-     * @brief erase element from tree by value
+     * @brief insert using hint as the place to start the search from
      */
-    size_type erase(const value_type& value)
+    iterator insert(const_iterator hint, value_type&& value)
     {
-        auto iter = find(value);
-        if (iter != end()) {
+        return emplace_hint_unique(hint, value, std::move(value)).first;
+    }
+
+    /*
+     * @brief insert
+     */
+    void insert(std::initializer_list<value_type> il)
+    {
+        insert(il.begin(), il.end());
+    }
+
+    /*
+     * @brief insert a range of values in any order
+     *
+     * The batch is sorted, in parallel when large, and deduplicated. A batch
+     * small against the tree goes in by finger search from the previously
+     * inserted value, a larger one is merged with the tree's in-order
+     * sequence and the tree is rebuilt balanced from the merged nodes, which
+     * is linear in the combined size. Existing nodes are reused, so iterators
+     * stay valid. For equal values the one already in the tree, then the
+     * first one in the batch, is kept. The values are staged with the tree's
+     * allocator and only pointers to them are sorted, values are never
+     * assigned, so types with const members such as the pairs of a map work.
+     */
+    template <typename InputIt,
+             typename = typename std::iterator_traits<InputIt>::iterator_category>
+    void insert(InputIt first, InputIt last)
+    {
+        std::vector<value_type, Allocator> staged(first, last, allocator());
+        insert_batch(staged);
+    }
+
+public:
+    /*
+     * @brief removes all data from tree
+     */
+    void clear()
+    {
+        balanced_tree::destroy(m_head, concurrency(m_size + m_lazy.m_tombstones));
+        free_slabs(m_slabs);
+        m_size = 0;
+        m_head = nullptr;
+        m_max = nullptr;
+        m_lazy.m_tombstones = 0;
+    }
+
+    /*
+     * @brief empties the tree at once and leaves freeing the nodes to a
+     *        background thread, same as clear() unless the allocator is
+     *        thread-safe
+     */
+    void clear_async()
+    {
+        if (!balanced_tree_thread_safe_allocator<Allocator>::value || m_head == nullptr) {
+            clear();
+            return;
+        }
+        auto detached = new balanced_tree(comparator(), allocator());
+        detached->steal(*this);
+        try {
+            bt_detail::reclaimer::instance().post([detached] {
+                delete detached;
+            });
+        } catch (...) {
+            delete detached;
+        }
+    }
+
+    /*
+     * @brief erase element from tree by position
+     */
+    iterator erase(const iterator position)
+    {
+        iterator new_position(position);
+        ++new_position;
+        erase_node(position.m_data);
+        return new_position;
+    }
+
+    /*
+     * @brief erase element from tree by position
+     */
+    iterator erase(const const_iterator position)
+    {
+        return erase(iterator{const_cast<bt_node*>(position.m_data)});
+    }
+
+    /*
+     * @brief erase element from tree by position
+     */
+    reverse_iterator erase(const reverse_iterator position)
+    {
+        reverse_iterator new_position(position);
+        ++new_position;
+        erase_node(position.m_data);
+        return new_position;
+    }
+
+    /*
+     * @brief erase element from tree by value
+     */
+    size_type erase(const value_type& value)
+    {
+        auto iter = find(value);
+        if (iter != end()) {
             erase(iter);
             return 1;
         }
         return 0;
     }
 
+public:
+    /*
+     * @brief turns lazy erase on or off
+     *
+     * In lazy mode erase only marks the node as a tombstone, without any
+     * restructuring. Lookups and iterators skip tombstones and inserting an
+     * equal value revives the node in place. Once tombstones make up more than
+     * compact_ratio of the nodes the tree is compacted. Turning the mode off
+     * compacts the tree.
+     */
+    void set_lazy_erase(bool enabled, double compact_ratio = 0.5)
+    {
+        m_lazy.m_enabled = enabled;
+        m_lazy.m_compact_ratio = compact_ratio;
+        if (!enabled) {
+            compact();
+        }
+    }
+
+    bool lazy_erase() const noexcept
+    {
+        return m_lazy.m_enabled;
+    }
+
+    /*
+     * @brief returns the number of erased nodes waiting for compaction
+     */
+    size_type tombstones() const noexcept
+    {
+        return m_lazy.m_tombstones;
+    }
+
+    /*
+     * @brief frees the tombstones and rebuilds the tree balanced from the
+     *        remaining nodes in linear time, iterators stay valid
+     */
+    void compact();
+
+    /*
+     * @brief moves all nodes, each with its value, into one contiguous block
+     *        in the given order, invalidates iterators and references
+     *
+     * Trees that went through a long run of inserts and erases have their
+     * nodes spread over the heap, so that descents and scans touch a new page
+     * on almost every step. The block is released on clear() or on the next
+     * relayout; the places of nodes erased in between are not reused. With
+     * huge_pages and std::allocator on Linux the block is backed by huge
+     * pages.
+     */
+    void relayout(balanced_tree_layout order = balanced_tree_layout::van_emde_boas,
+                  bool huge_pages = false);
+
 public:
     /*
      * @brief returns true  if tree is empty false another case
      */
     bool empty() const noexcept
     {
-        return m_head == nullptr;
+        return m_size == 0;
     }
 
     /*
@@ -441,7 +1241,7 @@ public:
      */
     iterator find(const value_type& value) noexcept
     {
-        return iterator{balanced_tree::find(m_head, value)};
+        return iterator{balanced_tree::live(balanced_tree::find(m_head, key_cache::probe(value)))};
     }
 
     /*
@@ -449,7 +1249,195 @@ public:
      */
     const_iterator find(const value_type& value) const noexcept
     {
-        return const_iterator{balanced_tree::find(m_head, value)};
+        return const_iterator{balanced_tree::live(balanced_tree::find(m_head, key_cache::probe(value)))};
+    }
+
+    /*
+     * @brief find element by a key comparable with the values, available
+     *        when the comparator is transparent
+     */
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator find(const K& key)
+    {
+        return iterator{balanced_tree::live(balanced_tree::find(m_head, key_cache::probe(key)))};
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    const_iterator find(const K& key) const
+    {
+        return const_iterator{balanced_tree::live(balanced_tree::find(m_head, key_cache::probe(key)))};
+    }
+
+public:
+    /*
+     * @brief returns the first element not ordered before value
+     */
+    iterator lower_bound(const value_type& value)
+    {
+        return iterator{balanced_tree::skip_forward(balanced_tree::lower_bound(m_head, key_cache::probe(value)))};
+    }
+
+    const_iterator lower_bound(const value_type& value) const
+    {
+        return const_iterator{balanced_tree::skip_forward(balanced_tree::lower_bound(m_head, key_cache::probe(value)))};
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator lower_bound(const K& key)
+    {
+        return iterator{balanced_tree::skip_forward(balanced_tree::lower_bound(m_head, key_cache::probe(key)))};
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    const_iterator lower_bound(const K& key) const
+    {
+        return const_iterator{balanced_tree::skip_forward(balanced_tree::lower_bound(m_head, key_cache::probe(key)))};
+    }
+
+    /*
+     * @brief returns the first element ordered after value
+     */
+    iterator upper_bound(const value_type& value)
+    {
+        return iterator{balanced_tree::skip_forward(balanced_tree::upper_bound(m_head, key_cache::probe(value)))};
+    }
+
+    const_iterator upper_bound(const value_type& value) const
+    {
+        return const_iterator{balanced_tree::skip_forward(balanced_tree::upper_bound(m_head, key_cache::probe(value)))};
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator upper_bound(const K& key)
+    {
+        return iterator{balanced_tree::skip_forward(balanced_tree::upper_bound(m_head, key_cache::probe(key)))};
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    const_iterator upper_bound(const K& key) const
+    {
+        return const_iterator{balanced_tree::skip_forward(balanced_tree::upper_bound(m_head, key_cache::probe(key)))};
+    }
+
+public:
+    /*
+     * @brief returns the summary of all elements
+     */
+    summary_type aggregate() const
+    {
+        return balanced_tree::subtree_summary(m_head);
+    }
+
+    /*
+     * @brief returns the summary of the elements within [lo, hi], combined
+     *        from O(log n) subtree summaries
+     */
+    summary_type aggregate(const value_type& lo, const value_type& hi) const
+    {
+        return aggregate(m_head, key_cache::probe(lo), key_cache::probe(hi));
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    summary_type aggregate(const K& lo, const K& hi) const
+    {
+        return aggregate(m_head, key_cache::probe(lo), key_cache::probe(hi));
+    }
+
+    /*
+     * @brief calls visit on the elements in order, skipping every subtree
+     *        whose summary fails descend, visit returns false to stop
+     *
+     * For intervals ordered by their start and summarised by the largest end
+     * point, descend tests that end point against the start of a query and
+     * visit stops at the first interval starting after its end. All k
+     * overlapping intervals are then reported in O((k + 1) log n).
+     */
+    template <typename Descend, typename Visit>
+    void visit_pruned(Descend descend, Visit visit) const
+    {
+        balanced_tree::visit_pruned(m_head, descend, visit);
+    }
+
+public:
+    /*
+     * @brief a run of consecutive elements, one piece of a partition
+     */
+    class const_range
+    {
+    public:
+        const_range(const_iterator first, const_iterator last, size_type size)
+            : m_first(first)
+            , m_last(last)
+            , m_size(size)
+        {}
+
+        const_iterator begin() const noexcept
+        {
+            return m_first;
+        }
+
+        const_iterator end() const noexcept
+        {
+            return m_last;
+        }
+
+        /*
+         * @brief number of elements in the run, exact with an augmentation
+         *        counting elements such as size_augment, counting tombstones
+         *        too with weight_balance and estimated from the subtree
+         *        heights otherwise
+         */
+        size_type size_hint() const noexcept
+        {
+            return m_size;
+        }
+
+    private:
+        const_iterator m_first;
+        const_iterator m_last;
+        size_type m_size;
+    };
+
+    /*
+     * @brief splits the elements into at most pieces runs of about the same
+     *        size, in order, for workers to scan side by side
+     *
+     * The runs are cut at subtree boundaries found in O(pieces log n) without
+     * visiting the elements. The runs stay valid until the tree is modified.
+     *
+     * How even the runs are depends on the subtree sizes the tree knows. With
+     * size_augment, or weight_balance without tombstones, the sizes are exact
+     * and no run exceeds the ideal size by more than about an eighth. AVL and
+     * red-black trees without it estimate sizes from the heights, and a run
+     * can then be twice the ideal size or more.
+     */
+    std::vector<const_range> partition(size_type pieces) const
+    {
+        std::vector<part> parts;
+        if (m_head != nullptr) {
+            parts.push_back(part{m_head, true, balanced_tree::subtree_size(m_head)});
+        }
+        return partition(parts, pieces, nullptr);
+    }
+
+    /*
+     * @brief partition of the elements within [lo, hi]
+     */
+    std::vector<const_range> partition(const value_type& lo, const value_type& hi, size_type pieces) const
+    {
+        const auto& high = key_cache::probe(hi);
+        std::vector<part> parts;
+        range_parts(key_cache::probe(lo), high, parts);
+        return partition(parts, pieces, balanced_tree::upper_bound(m_head, high));
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    std::vector<const_range> partition(const K& lo, const K& hi, size_type pieces) const
+    {
+        const auto& high = key_cache::probe(hi);
+        std::vector<part> parts;
+        range_parts(key_cache::probe(lo), high, parts);
+        return partition(parts, pieces, balanced_tree::upper_bound(m_head, high));
     }
 
 public:
@@ -458,12 +1446,12 @@ public:
      */
     iterator begin()
     {
-        return iterator{balanced_tree::min(m_head)};
+        return iterator{balanced_tree::skip_forward(balanced_tree::min(m_head))};
     }
 
     const_iterator begin() const noexcept
     {
-        return const_iterator{balanced_tree::min(m_head)};
+        return const_iterator{balanced_tree::skip_forward(balanced_tree::min(m_head))};
     }
 
     /*
@@ -502,12 +1490,12 @@ public:
      */
     reverse_iterator rbegin()
     {
-        return reverse_iterator(balanced_tree::max(m_head));
+        return reverse_iterator(balanced_tree::skip_backward(m_max));
     }
 
     const_reverse_iterator rbegin() const noexcept
     {
-        return const_reverse_iterator(balanced_tree::max(m_head));
+        return const_reverse_iterator(balanced_tree::skip_backward(m_max));
     }
 
     /*
@@ -522,302 +1510,1549 @@ public:
     {
         return const_reverse_iterator();
     }
-    // @}
 
-private:
-    static bt_node* predecessor(const bt_node* node);
-    static bt_node* successor(const bt_node* node);
-    static bt_node* max(bt_node* node);
-    static bt_node* min(bt_node* node);
-    static void destroy(bt_node* node);
-    static void destroy_one(bt_node* node);
-    static const bt_node* find(const bt_node* node, const value_type& value);
-    static bt_node* find(bt_node* node, const value_type& value);
-    static void left_rotate(balanced_tree* tree, bt_node* x);
-    static void right_rotate(balanced_tree* tree, bt_node* y);
-    static std::pair<iterator, bool> insert(const value_type& value, balanced_tree* tree, bt_node* parent, bt_node* node);
-    static int height(const bt_node* node);
-    static int direction(const bt_node* node);
-    static void refresh_heights(bt_node* node);
-    static void swap(bt_node* src, bt_node* dest);
-    static void copy(const bt_node* src, bt_node*& dest, bt_node* parent);
+#ifdef BALANCED_TREE_STATS
+public:
+    /*
+     * @brief number of rotations done by this tree since construction
+     */
+    size_t rotations() const noexcept
+    {
+        return m_rotations;
+    }
 
-    bt_node* m_head;
-    size_type m_size;
+    /*
+     * @brief sum of the depths of all nodes, root has depth 1
+     */
+    size_t path_length() const noexcept
+    {
+        return balanced_tree::path_length(m_head, 1);
+    }
+#endif
+    // @}
 
 private:
-    static Compare s_less_than;
-    static Allocator s_allocator;
-};
+    Compare& comparator() noexcept
+    {
+        return compare_holder::get();
+    }
 
-template <typename T, typename Compare, typename Allocator>
-Compare balanced_tree<T, Compare, Allocator>::s_less_than;
+    const Compare& comparator() const noexcept
+    {
+        return compare_holder::get();
+    }
 
-template <typename T, typename Compare, typename Allocator>
-Allocator balanced_tree<T, Compare, Allocator>::s_allocator;
+    Allocator& allocator() noexcept
+    {
+        return allocator_holder::get();
+    }
 
-template <typename T, typename Compare, typename Allocator>
-typename balanced_tree<T, Compare, Allocator>::bt_node* balanced_tree<T, Compare, Allocator>::predecessor(const bt_node* node)
-{
-    if (node == nullptr) {
-        return nullptr;
+    const Allocator& allocator() const noexcept
+    {
+        return allocator_holder::get();
     }
-    if (node->m_left_child != nullptr) {
-        return balanced_tree::max(node->m_left_child);
+
+    template <typename K>
+    bool node_less(const bt_node* node, const K& key) const
+    {
+        return key_cache::less(comparator(), node->cache(), *node->m_value, key);
     }
-    auto parent = node->m_parent;
-    auto current = node;
-    while (parent != nullptr && current == parent->m_left_child) {
-        current = parent;
-        parent = parent->m_parent;
+
+    template <typename K>
+    bool node_greater(const bt_node* node, const K& key) const
+    {
+        return key_cache::greater(comparator(), node->cache(), *node->m_value, key);
     }
-    return parent;
-}
 
+    /*
+     * @brief true_type when the key cache hook orders a node against K with a
+     *        single three-way call
+     */
+    template <typename K, typename = void>
+    struct has_compare
+        : std::false_type
+    {};
+
+    template <typename K>
+    struct has_compare<K, decltype(void(key_cache::compare(std::declval<const Compare&>(),
+                                                           std::declval<const key_cache_type&>(),
+                                                           std::declval<const T&>(),
+                                                           std::declval<const K&>())))>
+        : std::true_type
+    {};
+
+    template <typename K>
+    int node_compare(const bt_node* node, const K& key) const
+    {
+        return key_cache::compare(comparator(), node->cache(), *node->m_value, key);
+    }
 
-template <typename T, typename Compare, typename Allocator>
-typename balanced_tree<T, Compare, Allocator>::bt_node* balanced_tree<T, Compare, Allocator>::successor(const bt_node* node)
-{
-    if (node == nullptr) {
-        return nullptr;
+    void copy_allocator(const balanced_tree& that, std::true_type)
+    {
+        allocator() = that.allocator();
     }
-    if (node->m_right_child != nullptr) {
-        return balanced_tree::min(node->m_right_child);
+
+    void copy_allocator(const balanced_tree&, std::false_type)
+    {
     }
-    auto parent = node->m_parent;
-    auto current = node;
-    while (parent != nullptr && current == parent->m_right_child) {
-        current = parent;
-        parent = parent->m_parent;
+
+    void move_assign(balanced_tree& that, std::true_type)
+    {
+        move_allocator(that, typename allocator_traits::propagate_on_container_move_assignment());
+        comparator() = std::move(that.comparator());
+        steal(that);
     }
-    return parent;
-}
 
-template <typename T, typename Compare, typename Allocator>
-typename balanced_tree<T, Compare, Allocator>::bt_node* balanced_tree<T, Compare, Allocator>::max(bt_node* node)
-{
-    if (node == nullptr) {
-        return nullptr;
+    void move_assign(balanced_tree& that, std::false_type)
+    {
+        comparator() = that.comparator();
+        if (allocator() == that.allocator()) {
+            steal(that);
+        } else {
+            move_from(that);
+        }
     }
-    auto tmp = node;
-    while (tmp->m_right_child != nullptr) {
-        tmp = tmp->m_right_child;
+
+    void move_allocator(balanced_tree& that, std::true_type)
+    {
+        allocator() = std::move(that.allocator());
     }
-    return tmp;
-}
 
-template <typename T, typename Compare, typename Allocator>
-typename balanced_tree<T, Compare, Allocator>::bt_node* balanced_tree<T, Compare, Allocator>::min(bt_node* node)
-{
-    if (node == nullptr) {
+    void move_allocator(balanced_tree&, std::false_type)
+    {
+    }
+
+    void swap_allocator(balanced_tree& that, std::true_type)
+    {
+        std::swap(allocator(), that.allocator());
+    }
+
+    void swap_allocator(balanced_tree&, std::false_type)
+    {
+    }
+
+    void steal(balanced_tree& that) noexcept
+    {
+        m_head = that.m_head;
+        m_size = that.m_size;
+        m_max = that.m_max;
+        m_lazy = that.m_lazy;
+        m_slabs.swap(that.m_slabs);
+        that.m_head = nullptr;
+        that.m_size = 0;
+        that.m_max = nullptr;
+        that.m_lazy.m_tombstones = 0;
+        that.m_slabs.clear();
+#ifdef BALANCED_TREE_STATS
+        m_rotations = that.m_rotations;
+        that.m_rotations = 0;
+#endif
+    }
+
+    /*
+     * @brief number of threads to copy or free a tree of size nodes with,
+     *        above the cutoff and only for thread-safe allocators
+     */
+    static unsigned concurrency(size_type size)
+    {
+        const size_type cutoff = 1 << 16;
+        if (!balanced_tree_thread_safe_allocator<Allocator>::value || size < cutoff) {
+            return 1;
+        }
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    void copy_from(const balanced_tree& that)
+    {
+        try {
+            copy(that.m_head, m_head, nullptr, concurrency(that.m_size + that.m_lazy.m_tombstones));
+        } catch (...) {
+            balanced_tree::destroy(m_head);
+            m_head = nullptr;
+            throw;
+        }
+        m_size = that.m_size;
+        m_max = balanced_tree::max(m_head);
+        m_lazy = that.m_lazy;
+    }
+
+    /*
+     * @brief moves the values of that into nodes of this tree's allocator,
+     *        on an exception the partial copy is freed and this tree left
+     *        empty
+     */
+    void move_from(balanced_tree& that)
+    {
+        try {
+            move_values(that.m_head, m_head, nullptr);
+        } catch (...) {
+            balanced_tree::destroy(m_head);
+            m_head = nullptr;
+            throw;
+        }
+        m_size = that.m_size;
+        m_max = balanced_tree::max(m_head);
+        m_lazy = that.m_lazy;
+        that.clear();
+    }
+
+    template <typename ... Args>
+    bt_node* create_node(Args&& ... args);
+    void destroy_node(bt_node* node);
+    slab allocate_slab(size_type count, bool huge_pages);
+    void free_slabs(std::vector<slab>& slabs);
+    void layout_nodes(balanced_tree_layout order, std::vector<bt_node*>& nodes) const;
+    static void van_emde_boas(bt_node* node, int levels, std::vector<bt_node*>& nodes,
+                              std::vector<bt_node*>& below);
+    static int levels(const bt_node* node);
+
+    static bt_node* predecessor(const bt_node* node);
+    static bt_node* successor(const bt_node* node);
+    static bt_node* skip_forward(bt_node* node);
+    static bt_node* skip_backward(bt_node* node);
+    static bt_node* live(bt_node* node);
+    void erase_node(bt_node* node);
+    void revive(bt_node* node, value_type* value);
+    static bt_node* max(bt_node* node);
+    static bt_node* min(bt_node* node);
+    void destroy(bt_node* node, unsigned threads = 1);
+    template <typename K>
+    bt_node* find(bt_node* node, const K& key) const;
+    template <typename K>
+    bt_node* find(bt_node* node, const K& key, std::true_type) const;
+    template <typename K>
+    bt_node* find(bt_node* node, const K& key, std::false_type) const;
+    template <typename K>
+    bt_node* lower_bound(bt_node* node, const K& key) const;
+    template <typename K>
+    bt_node* upper_bound(bt_node* node, const K& key) const;
+    static void left_rotate(balanced_tree* tree, bt_node* x);
+    static void right_rotate(balanced_tree* tree, bt_node* y);
+    template <typename V>
+    std::pair<iterator, bool> insert_unique(V&& value);
+    struct insert_point
+    {
+        bt_node* m_parent;
+        bool m_left;
+        bt_node* m_equal;
+    };
+
+    template <typename K, typename ... Args>
+    std::pair<iterator, bool> emplace_unique(const K& key, Args&& ... args);
+    template <typename K, typename ... Args>
+    std::pair<iterator, bool> emplace_hint_unique(const_iterator hint, const K& key, Args&& ... args);
+    template <typename ... Args>
+    std::pair<iterator, bool> emplace_at(const insert_point& point, Args&& ... args);
+    template <typename K>
+    insert_point find_insert_point(bt_node* node, const K& key) const;
+    template <typename K>
+    insert_point find_insert_point(bt_node* node, const K& key, std::true_type) const;
+    template <typename K>
+    insert_point find_insert_point(bt_node* node, const K& key, std::false_type) const;
+    template <typename K>
+    insert_point finger_insert_point(bt_node* hint, const K& key) const;
+    template <typename V>
+    iterator insert_equal(V&& value);
+    void insert_batch(std::vector<value_type, Allocator>& staged);
+    void rebuild(bt_node* const* nodes, size_type count);
+    bt_node* build(bt_node* const* nodes, size_type count, bt_node* parent, int depth, int red_depth);
+    void link_node(bt_node* node, bt_node* parent, bool left);
+    void unlink_node(bt_node* node);
+    void transplant(bt_node* node, bt_node* child);
+    void copy(const bt_node* src, bt_node*& dest, bt_node* parent, unsigned threads = 1);
+    void move_values(bt_node* src, bt_node*& dest, bt_node* parent);
+
+    // @{partition
+    struct part
+    {
+        bt_node* m_node;
+        bool m_whole;
+        size_type m_size;
+    };
+
+    template <typename P>
+    void range_parts(const P& lo, const P& hi, std::vector<part>& parts) const;
+    std::vector<const_range> partition(std::vector<part>& parts, size_type pieces, bt_node* last) const;
+    static void split_parts(const part& piece, size_type threshold, std::vector<part>& parts);
+
+    template <typename A, typename = void>
+    struct counts_elements
+        : std::false_type
+    {};
+
+    template <typename A>
+    struct counts_elements<A, decltype(void(A::size(std::declval<const typename A::summary_type&>())))>
+        : std::true_type
+    {};
+
+    static size_type subtree_size(const bt_node* node)
+    {
+        return subtree_size(node, counts_elements<Augment>());
+    }
+
+    static size_type subtree_size(const bt_node* node, std::true_type)
+    {
+        return Augment::size(node->summary());
+    }
+
+    static size_type subtree_size(const bt_node* node, std::false_type)
+    {
+        return subtree_size(node, Balance());
+    }
+
+    static size_type subtree_size(const bt_node* node, avl_balance);
+    static size_type subtree_size(const bt_node* node, red_black_balance);
+    static size_type subtree_size(const bt_node* node, weight_balance);
+    // @}
+
+    // @{augmentation
+    static summary_data value_summary(const bt_node* node);
+    static summary_data subtree_summary(const bt_node* node);
+    static void summarize(bt_node*, std::true_type) {}
+    static void summarize(bt_node* node, std::false_type);
+    static void summarize_path(bt_node*, std::true_type) {}
+    static void summarize_path(bt_node* node, std::false_type);
+    template <typename P>
+    summary_data aggregate(const bt_node* node, const P& lo, const P& hi) const;
+    template <typename Descend, typename Visit>
+    static bool visit_pruned(const bt_node* node, Descend& descend, Visit& visit);
+    // @}
+
+    // @{balancing policies
+    static void refresh(bt_node* node);
+    static void refresh(bt_node* node, avl_balance);
+    static void refresh(bt_node*, red_black_balance) {}
+    static void refresh(bt_node* node, weight_balance);
+    static void init_balance(bt_node* node, avl_balance);
+    static void init_balance(bt_node* node, red_black_balance);
+    static void init_balance(bt_node* node, weight_balance);
+    static void built_balance(bt_node* node, bool bottom, avl_balance);
+    static void built_balance(bt_node* node, bool bottom, red_black_balance);
+    static void built_balance(bt_node* node, bool bottom, weight_balance);
+    void insert_fixup(bt_node* node, avl_balance);
+    void insert_fixup(bt_node* node, red_black_balance);
+    void insert_fixup(bt_node* node, weight_balance);
+    void erase_fixup(bt_node* child, bt_node* parent, balance_data removed, avl_balance);
+    void erase_fixup(bt_node* child, bt_node* parent, balance_data removed, red_black_balance);
+    void erase_fixup(bt_node* child, bt_node* parent, balance_data removed, weight_balance);
+
+    static int height(const bt_node* node);
+    static int direction(const bt_node* node);
+    bt_node* avl_rebalance(bt_node* node);
+
+    static bool is_red(const bt_node* node);
+
+    static size_type weight(const bt_node* node);
+    bt_node* weight_rebalance(bt_node* node);
+    // @}
+
+#ifdef BALANCED_TREE_STATS
+    static size_t path_length(const bt_node* node, size_t depth);
+#endif
+
+    bt_node* m_head;
+    size_type m_size;
+    bt_node* m_max;
+    lazy_erase_state m_lazy;
+    std::vector<slab> m_slabs;
+#ifdef BALANCED_TREE_STATS
+    size_t m_rotations = 0;
+#endif
+};
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+template <typename ... Args>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::bt_node* balanced_tree<T, Compare, Allocator, Balance, Augment>::create_node(Args&& ... args)
+{
+    auto value = allocator_traits::allocate(allocator(), 1);
+    try {
+        allocator_traits::construct(allocator(), value, std::forward<Args>(args)...);
+    } catch (...) {
+        allocator_traits::deallocate(allocator(), value, 1);
+        throw;
+    }
+    node_allocator node_alloc(allocator());
+    bt_node* node = nullptr;
+    try {
+        node = node_allocator_traits::allocate(node_alloc, 1);
+        node_allocator_traits::construct(node_alloc, node, value);
+    } catch (...) {
+        if (node != nullptr) {
+            node_allocator_traits::deallocate(node_alloc, node, 1);
+        }
+        allocator_traits::destroy(allocator(), value);
+        allocator_traits::deallocate(allocator(), value, 1);
+        throw;
+    }
+    return node;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::destroy_node(bt_node* node)
+{
+    allocator_traits::destroy(allocator(), node->m_value);
+    if (!node->m_slab_value) {
+        allocator_traits::deallocate(allocator(), node->m_value, 1);
+    }
+    const bool slab_node = node->m_slab_node;
+    node_allocator node_alloc(allocator());
+    node_allocator_traits::destroy(node_alloc, node);
+    if (!slab_node) {
+        node_allocator_traits::deallocate(node_alloc, node, 1);
+    }
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::bt_node* balanced_tree<T, Compare, Allocator, Balance, Augment>::predecessor(const bt_node* node)
+{
+    if (node == nullptr) {
         return nullptr;
     }
-    auto tmp = node;
-    while (tmp->m_left_child != nullptr) {
-        tmp = tmp->m_left_child;
+    if (node->m_left_child != nullptr) {
+        return balanced_tree::max(node->m_left_child);
+    }
+    auto parent = node->m_parent;
+    auto current = node;
+    while (parent != nullptr && current == parent->m_left_child) {
+        current = parent;
+        parent = parent->m_parent;
+    }
+    return parent;
+}
+
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::bt_node* balanced_tree<T, Compare, Allocator, Balance, Augment>::successor(const bt_node* node)
+{
+    if (node == nullptr) {
+        return nullptr;
+    }
+    if (node->m_right_child != nullptr) {
+        return balanced_tree::min(node->m_right_child);
+    }
+    auto parent = node->m_parent;
+    auto current = node;
+    while (parent != nullptr && current == parent->m_right_child) {
+        current = parent;
+        parent = parent->m_parent;
+    }
+    return parent;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::bt_node* balanced_tree<T, Compare, Allocator, Balance, Augment>::skip_forward(bt_node* node)
+{
+    while (node != nullptr && node->m_tombstone) {
+        node = balanced_tree::successor(node);
+    }
+    return node;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::bt_node* balanced_tree<T, Compare, Allocator, Balance, Augment>::skip_backward(bt_node* node)
+{
+    while (node != nullptr && node->m_tombstone) {
+        node = balanced_tree::predecessor(node);
+    }
+    return node;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::bt_node* balanced_tree<T, Compare, Allocator, Balance, Augment>::live(bt_node* node)
+{
+    return node != nullptr && !node->m_tombstone ? node : nullptr;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::erase_node(bt_node* node)
+{
+    if (!m_lazy.m_enabled) {
+        unlink_node(node);
+        destroy_node(node);
+        return;
+    }
+    node->m_tombstone = true;
+    ++m_lazy.m_tombstones;
+    --m_size;
+    balanced_tree::summarize_path(node, unaugmented());
+    if (m_lazy.m_tombstones > m_lazy.m_compact_ratio * (m_size + m_lazy.m_tombstones)) {
+        compact();
+    }
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::revive(bt_node* node, value_type* value)
+{
+    // the key cache is left as is, the new value is equivalent to the old one
+    allocator_traits::destroy(allocator(), node->m_value);
+    if (!node->m_slab_value) {
+        allocator_traits::deallocate(allocator(), node->m_value, 1);
+    }
+    node->m_value = value;
+    node->m_slab_value = false;
+    node->m_tombstone = false;
+    --m_lazy.m_tombstones;
+    ++m_size;
+    balanced_tree::summarize_path(node, unaugmented());
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::compact()
+{
+    if (m_lazy.m_tombstones == 0) {
+        return;
+    }
+    std::vector<bt_node*> nodes;
+    nodes.reserve(m_size);
+    std::vector<bt_node*> tombstones;
+    tombstones.reserve(m_lazy.m_tombstones);
+    for (auto node = balanced_tree::min(m_head); node != nullptr; node = balanced_tree::successor(node)) {
+        (node->m_tombstone ? tombstones : nodes).push_back(node);
+    }
+    for (auto node : tombstones) {
+        destroy_node(node);
+    }
+    m_lazy.m_tombstones = 0;
+    rebuild(nodes.data(), nodes.size());
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::relayout(balanced_tree_layout order, bool huge_pages)
+{
+    const size_type count = m_size + m_lazy.m_tombstones;
+    if (count == 0) {
+        return;
+    }
+    std::vector<bt_node*> nodes;
+    nodes.reserve(count);
+    layout_nodes(order, nodes);
+
+    std::vector<slab> slabs;
+    slabs.reserve(1);
+    slabs.push_back(allocate_slab(count, huge_pages));
+    auto entries = slabs.back().m_entries;
+    auto slab_node = [entries](size_type i) {
+        return reinterpret_cast<bt_node*>(entries[i].m_node);
+    };
+    auto slab_value = [entries](size_type i) {
+        return reinterpret_cast<value_type*>(entries[i].m_value);
+    };
+    // the nodes are copied before any value is moved, a failure then always
+    // finds the tree as it was
+    node_allocator node_alloc(allocator());
+    size_type nodes_built = 0;
+    size_type values_built = 0;
+    try {
+        for (; nodes_built < count; ++nodes_built) {
+            node_allocator_traits::construct(node_alloc, slab_node(nodes_built),
+                                             static_cast<const bt_node&>(*nodes[nodes_built]));
+        }
+        for (; values_built < count; ++values_built) {
+            allocator_traits::construct(allocator(), slab_value(values_built),
+                                        std::move_if_noexcept(*nodes[values_built]->m_value));
+        }
+    } catch (...) {
+        for (size_type i = 0; i < values_built; ++i) {
+            allocator_traits::destroy(allocator(), slab_value(i));
+        }
+        for (size_type i = 0; i < nodes_built; ++i) {
+            node_allocator_traits::destroy(node_alloc, slab_node(i));
+        }
+        free_slabs(slabs);
+        throw;
+    }
+    for (size_type i = 0; i < count; ++i) {
+        auto node = slab_node(i);
+        node->m_value = slab_value(i);
+        node->m_slab_node = true;
+        node->m_slab_value = true;
+    }
+
+    // the old nodes forward to their copies through m_parent, which the
+    // copies rewire their links with
+    for (size_type i = 0; i < count; ++i) {
+        nodes[i]->m_parent = slab_node(i);
+    }
+    for (size_type i = 0; i < count; ++i) {
+        auto node = slab_node(i);
+        if (node->m_left_child != nullptr) {
+            node->m_left_child = node->m_left_child->m_parent;
+        }
+        if (node->m_right_child != nullptr) {
+            node->m_right_child = node->m_right_child->m_parent;
+        }
+        if (node->m_parent != nullptr) {
+            node->m_parent = node->m_parent->m_parent;
+        }
+    }
+    m_head = m_head->m_parent;
+    m_max = m_max != nullptr ? m_max->m_parent : nullptr;
+    for (auto node : nodes) {
+        destroy_node(node);
+    }
+    free_slabs(m_slabs);
+    m_slabs.swap(slabs);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::slab balanced_tree<T, Compare, Allocator, Balance, Augment>::allocate_slab(size_type count, bool huge_pages)
+{
+    if (huge_pages && std::is_same<Allocator, std::allocator<T> >::value) {
+        auto memory = bt_detail::huge_page_allocate(count * sizeof(slab_entry));
+        if (memory != nullptr) {
+            return slab{static_cast<slab_entry*>(memory), count, true};
+        }
+    }
+    slab_allocator slab_alloc(allocator());
+    return slab{slab_allocator_traits::allocate(slab_alloc, count), count, false};
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::free_slabs(std::vector<slab>& slabs)
+{
+    slab_allocator slab_alloc(allocator());
+    for (const auto& block : slabs) {
+        if (block.m_huge_pages) {
+            bt_detail::huge_page_deallocate(block.m_entries);
+        } else {
+            slab_allocator_traits::deallocate(slab_alloc, block.m_entries, block.m_count);
+        }
+    }
+    slabs.clear();
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::layout_nodes(balanced_tree_layout order, std::vector<bt_node*>& nodes) const
+{
+    switch (order) {
+    case balanced_tree_layout::in_order:
+        for (auto node = balanced_tree::min(m_head); node != nullptr; node = balanced_tree::successor(node)) {
+            nodes.push_back(node);
+        }
+        break;
+    case balanced_tree_layout::breadth_first:
+        nodes.push_back(m_head);
+        for (size_type i = 0; i < nodes.size(); ++i) {
+            if (nodes[i]->m_left_child != nullptr) {
+                nodes.push_back(nodes[i]->m_left_child);
+            }
+            if (nodes[i]->m_right_child != nullptr) {
+                nodes.push_back(nodes[i]->m_right_child);
+            }
+        }
+        break;
+    case balanced_tree_layout::van_emde_boas:
+        {
+            std::vector<bt_node*> below;
+            balanced_tree::van_emde_boas(m_head, balanced_tree::levels(m_head), nodes, below);
+        }
+        break;
+    }
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::van_emde_boas(bt_node* node, int levels, std::vector<bt_node*>& nodes,
+                                                                          std::vector<bt_node*>& below)
+{
+    // lays out the top levels of the subtree of node, appending the roots
+    // of the subtrees cut off below them; the top half of the levels goes
+    // first, then each of the subtrees hanging from it
+    if (node == nullptr) {
+        return;
+    }
+    if (levels == 1) {
+        nodes.push_back(node);
+        if (node->m_left_child != nullptr) {
+            below.push_back(node->m_left_child);
+        }
+        if (node->m_right_child != nullptr) {
+            below.push_back(node->m_right_child);
+        }
+        return;
+    }
+    const int top = levels / 2;
+    std::vector<bt_node*> middle;
+    balanced_tree::van_emde_boas(node, top, nodes, middle);
+    for (auto root : middle) {
+        balanced_tree::van_emde_boas(root, levels - top, nodes, below);
+    }
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+int balanced_tree<T, Compare, Allocator, Balance, Augment>::levels(const bt_node* node)
+{
+    if (node == nullptr) {
+        return 0;
+    }
+    return 1 + std::max(balanced_tree::levels(node->m_left_child), balanced_tree::levels(node->m_right_child));
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::bt_node* balanced_tree<T, Compare, Allocator, Balance, Augment>::max(bt_node* node)
+{
+    if (node == nullptr) {
+        return nullptr;
+    }
+    auto tmp = node;
+    while (tmp->m_right_child != nullptr) {
+        tmp = tmp->m_right_child;
+    }
+    return tmp;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::bt_node* balanced_tree<T, Compare, Allocator, Balance, Augment>::min(bt_node* node)
+{
+    if (node == nullptr) {
+        return nullptr;
+    }
+    auto tmp = node;
+    while (tmp->m_left_child != nullptr) {
+        tmp = tmp->m_left_child;
+    }
+    return tmp;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::destroy(bt_node* node, unsigned threads)
+{
+    if (node == nullptr) {
+        return;
+    }
+    // the subtrees of a balanced tree are about the same size, each half of
+    // the threads frees one of them
+    std::future<void> left;
+    if (threads > 1) {
+        try {
+            left = std::async(std::launch::async, [this, node, threads] {
+                destroy(node->m_left_child, threads / 2);
+            });
+        } catch (...) {
+        }
+    }
+    if (!left.valid()) {
+        destroy(node->m_left_child);
+    }
+    destroy(node->m_right_child, threads - threads / 2);
+    if (left.valid()) {
+        left.get();
+    }
+    node->m_left_child = nullptr;
+    node->m_right_child = nullptr;
+    destroy_node(node);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+template <typename K>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::bt_node* balanced_tree<T, Compare, Allocator, Balance, Augment>::find(bt_node* node, const K& key) const
+{
+    return find(node, key, has_compare<K>());
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+template <typename K>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::bt_node* balanced_tree<T, Compare, Allocator, Balance, Augment>::find(bt_node* node, const K& key, std::true_type) const
+{
+    while (node != nullptr) {
+        const int order = node_compare(node, key);
+        if (order < 0) {
+            node = node->m_right_child;
+        } else if (order > 0) {
+            node = node->m_left_child;
+        } else {
+            return node;
+        }
+    }
+    return nullptr;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+template <typename K>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::bt_node* balanced_tree<T, Compare, Allocator, Balance, Augment>::find(bt_node* node, const K& key, std::false_type) const
+{
+    // one comparison per level down to the lower bound, then a single check
+    // for equality instead of testing both orders at every node
+    node = lower_bound(node, key);
+    return node != nullptr && !node_greater(node, key) ? node : nullptr;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+template <typename K>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::bt_node* balanced_tree<T, Compare, Allocator, Balance, Augment>::lower_bound(bt_node* node, const K& key) const
+{
+    bt_node* result = nullptr;
+    while (node != nullptr) {
+        if (node_less(node, key)) {
+            node = node->m_right_child;
+        } else {
+            result = node;
+            node = node->m_left_child;
+        }
+    }
+    return result;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+template <typename K>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::bt_node* balanced_tree<T, Compare, Allocator, Balance, Augment>::upper_bound(bt_node* node, const K& key) const
+{
+    bt_node* result = nullptr;
+    while (node != nullptr) {
+        if (node_greater(node, key)) {
+            result = node;
+            node = node->m_left_child;
+        } else {
+            node = node->m_right_child;
+        }
+    }
+    return result;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::left_rotate(balanced_tree* tree, bt_node* x)
+{
+    auto y = x->m_right_child;
+    if (y == nullptr) {
+        return;
+    }
+    x->m_right_child = y->m_left_child;
+    if (y->m_left_child != nullptr) {
+        y->m_left_child->m_parent = x;
+    }
+    y->m_parent = x->m_parent;
+    if (x->m_parent == nullptr) {
+        tree->m_head = y;
+    } else {
+        if (x->m_parent->m_left_child == x) {
+            x->m_parent->m_left_child = y;
+        } else {
+            x->m_parent->m_right_child = y;
+        }
+    }
+    y->m_left_child = x;
+    x->m_parent = y;
+    balanced_tree::refresh(x);
+    balanced_tree::refresh(y);
+#ifdef BALANCED_TREE_STATS
+    ++tree->m_rotations;
+#endif
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::right_rotate(balanced_tree* tree, bt_node* y)
+{
+    auto x = y->m_left_child;
+    if (x == nullptr) {
+        return;
+    }
+    y->m_left_child = x->m_right_child;
+    if (x->m_right_child != nullptr) {
+        x->m_right_child->m_parent = y;
+    }
+    x->m_parent = y->m_parent;
+    if (y->m_parent == nullptr) {
+        tree->m_head = x;
+    } else {
+        if (y->m_parent->m_left_child == y) {
+            y->m_parent->m_left_child = x;
+        } else {
+            y->m_parent->m_right_child = x;
+        }
+    }
+    x->m_right_child = y;
+    y->m_parent = x;
+    balanced_tree::refresh(y);
+    balanced_tree::refresh(x);
+#ifdef BALANCED_TREE_STATS
+    ++tree->m_rotations;
+#endif
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+template <typename V>
+std::pair<typename balanced_tree<T, Compare, Allocator, Balance, Augment>::iterator, bool> balanced_tree<T, Compare, Allocator, Balance, Augment>::insert_unique(V&& value)
+{
+    return emplace_unique(value, std::forward<V>(value));
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+template <typename K, typename ... Args>
+std::pair<typename balanced_tree<T, Compare, Allocator, Balance, Augment>::iterator, bool> balanced_tree<T, Compare, Allocator, Balance, Augment>::emplace_unique(const K& key, Args&& ... args)
+{
+    // appending past the maximum costs a single comparison
+    const auto& probe = key_cache::probe(key);
+    if (m_max != nullptr && node_less(m_max, probe)) {
+        return emplace_at(insert_point{m_max, false, nullptr}, std::forward<Args>(args)...);
+    }
+    return emplace_at(find_insert_point(m_head, probe), std::forward<Args>(args)...);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+template <typename K, typename ... Args>
+std::pair<typename balanced_tree<T, Compare, Allocator, Balance, Augment>::iterator, bool> balanced_tree<T, Compare, Allocator, Balance, Augment>::emplace_hint_unique(const_iterator hint, const K& key, Args&& ... args)
+{
+    // appending past the maximum stays a single comparison whatever the
+    // hint, so passing the previously inserted position while keys mostly
+    // ascend costs no more than no hint, the late keys then meet the side of
+    // the hint they are on with the first comparison
+    auto node = const_cast<bt_node*>(hint.m_data);
+    const auto& probe = key_cache::probe(key);
+    if (m_max != nullptr && node_less(m_max, probe)) {
+        return emplace_at(insert_point{m_max, false, nullptr}, std::forward<Args>(args)...);
+    }
+    if (node == nullptr) {
+        return emplace_at(find_insert_point(m_head, probe), std::forward<Args>(args)...);
+    }
+    return emplace_at(finger_insert_point(node, probe), std::forward<Args>(args)...);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+template <typename ... Args>
+std::pair<typename balanced_tree<T, Compare, Allocator, Balance, Augment>::iterator, bool> balanced_tree<T, Compare, Allocator, Balance, Augment>::emplace_at(const insert_point& point, Args&& ... args)
+{
+    // the value is constructed only once the key is known to be missing
+    if (point.m_equal != nullptr) {
+        if (!point.m_equal->m_tombstone) {
+            return std::make_pair(iterator{point.m_equal}, false);
+        }
+        auto value = allocator_traits::allocate(allocator(), 1);
+        try {
+            allocator_traits::construct(allocator(), value, std::forward<Args>(args)...);
+        } catch (...) {
+            allocator_traits::deallocate(allocator(), value, 1);
+            throw;
+        }
+        revive(point.m_equal, value);
+        return std::make_pair(iterator{point.m_equal}, true);
+    }
+    auto new_node = create_node(std::forward<Args>(args)...);
+    link_node(new_node, point.m_parent, point.m_left);
+    return std::make_pair(iterator{new_node}, true);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+template <typename K>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::insert_point balanced_tree<T, Compare, Allocator, Balance, Augment>::find_insert_point(bt_node* node, const K& key) const
+{
+    return find_insert_point(node, key, has_compare<K>());
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+template <typename K>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::insert_point balanced_tree<T, Compare, Allocator, Balance, Augment>::find_insert_point(bt_node* node, const K& key, std::true_type) const
+{
+    insert_point point{nullptr, false, nullptr};
+    while (node != nullptr) {
+        point.m_parent = node;
+        const int order = node_compare(node, key);
+        if (order > 0) {
+            point.m_left = true;
+            node = node->m_left_child;
+        } else if (order < 0) {
+            point.m_left = false;
+            node = node->m_right_child;
+        } else {
+            point.m_equal = node;
+            break;
+        }
+    }
+    return point;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+template <typename K>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::insert_point balanced_tree<T, Compare, Allocator, Balance, Augment>::find_insert_point(bt_node* node, const K& key, std::false_type) const
+{
+    // descends to a leaf remembering the last node not before the key, only
+    // that node can be equal to it
+    insert_point point{nullptr, false, nullptr};
+    bt_node* candidate = nullptr;
+    while (node != nullptr) {
+        point.m_parent = node;
+        if (node_less(node, key)) {
+            point.m_left = false;
+            node = node->m_right_child;
+        } else {
+            candidate = node;
+            point.m_left = true;
+            node = node->m_left_child;
+        }
+    }
+    if (candidate != nullptr && !node_greater(candidate, key)) {
+        point.m_equal = candidate;
+    }
+    return point;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+template <typename K>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::insert_point balanced_tree<T, Compare, Allocator, Balance, Augment>::finger_insert_point(bt_node* hint, const K& key) const
+{
+    // climbing only compares at the ancestors bounding the subtree on the
+    // side of the key, the search then descends from the first subtree that
+    // is known to contain the key's position
+    if (node_greater(hint, key)) {
+        auto prev = balanced_tree::predecessor(hint);
+        if (prev == nullptr || node_less(prev, key)) {
+            if (hint->m_left_child == nullptr) {
+                return insert_point{hint, true, nullptr};
+            }
+            return insert_point{prev, false, nullptr};
+        }
+        auto node = prev;
+        while (node->m_parent != nullptr &&
+               (node == node->m_parent->m_left_child || !node_less(node->m_parent, key))) {
+            node = node->m_parent;
+        }
+        return find_insert_point(node, key);
+    }
+    if (node_less(hint, key)) {
+        auto next = balanced_tree::successor(hint);
+        if (next == nullptr || node_greater(next, key)) {
+            if (hint->m_right_child == nullptr) {
+                return insert_point{hint, false, nullptr};
+            }
+            return insert_point{next, true, nullptr};
+        }
+        auto node = next;
+        while (node->m_parent != nullptr &&
+               (node == node->m_parent->m_right_child || !node_greater(node->m_parent, key))) {
+            node = node->m_parent;
+        }
+        return find_insert_point(node, key);
     }
-    return tmp;
+    return insert_point{nullptr, false, hint};
 }
 
-template <typename T, typename Compare, typename Allocator>
-void balanced_tree<T, Compare, Allocator>::destroy(bt_node* node)
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+template <typename V>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::iterator balanced_tree<T, Compare, Allocator, Balance, Augment>::insert_equal(V&& value)
 {
-    if (node == nullptr) {
-        return;
+    // equal values go after the ones already in the tree
+    bt_node* parent = nullptr;
+    bool left = false;
+    auto node = m_head;
+    const auto& probe = key_cache::probe(value);
+    while (node != nullptr) {
+        parent = node;
+        left = node_greater(node, probe);
+        node = left ? node->m_left_child : node->m_right_child;
     }
-    destroy(node->m_left_child);
-    node->m_left_child = nullptr;
-    destroy(node->m_right_child);
-    node->m_right_child = nullptr;
-    delete node;
+    auto new_node = create_node(std::forward<V>(value));
+    link_node(new_node, parent, left);
+    return iterator{new_node};
 }
 
-template <typename T, typename Compare, typename Allocator>
-void balanced_tree<T, Compare, Allocator>::destroy_one(bt_node* node)
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::insert_batch(std::vector<value_type, Allocator>& staged)
 {
-    const auto dir = balanced_tree::direction(node);
-    if (dir == 0) {
-        if (node->m_parent->m_left_child == node) {
-            node->m_parent->m_left_child = nullptr;
-        } else {
-            node->m_parent->m_right_child = nullptr;
+    if (staged.empty()) {
+        return;
+    }
+    // sorting pointers keeps the values in place, the nodes are still
+    // created in key order, next to each other
+    typedef typename allocator_traits::template rebind_alloc<value_type*> pointer_allocator;
+    std::vector<value_type*, pointer_allocator> batch{pointer_allocator(allocator())};
+    batch.reserve(staged.size());
+    for (auto& value : staged) {
+        batch.push_back(&value);
+    }
+    const auto& comp = comparator();
+    auto less = [&comp](const value_type* lhs, const value_type* rhs) {
+        return comp(*lhs, *rhs);
+    };
+    bt_detail::parallel_stable_sort(batch.begin(), batch.end(), less,
+                                    std::thread::hardware_concurrency());
+    batch.erase(std::unique(batch.begin(), batch.end(), [&less](const value_type* lhs, const value_type* rhs) {
+        return !less(lhs, rhs);
+    }), batch.end());
+
+    size_type depth = 0;
+    while ((size_type(1) << depth) <= m_size) {
+        ++depth;
+    }
+    if (batch.size() * depth < m_size) {
+        const_iterator hint = end();
+        for (auto value : batch) {
+            hint = emplace_hint_unique(hint, *value, std::move(*value)).first;
         }
-        delete node;
-    } else {
-        decltype(node) leaf_node = nullptr;
-        decltype(node) sub_tree_root = nullptr;
-        if (dir > 0) {
-            leaf_node = balanced_tree::min(node->m_right_child);
-            sub_tree_root = node->m_right_child;
-        } else {
-            leaf_node = balanced_tree::max(node->m_left_child);
-            sub_tree_root = node->m_left_child;
+        return;
+    }
+
+    // tombstones met by the merge are revived when the batch has their value
+    // and freed otherwise
+    std::vector<bt_node*> nodes;
+    nodes.reserve(m_size + m_lazy.m_tombstones + batch.size());
+    std::vector<bt_node*> created;
+    created.reserve(batch.size());
+    std::vector<bt_node*> tombstones;
+    auto node = balanced_tree::min(m_head);
+    try {
+        for (auto value : batch) {
+            const auto& probe = key_cache::probe(*value);
+            for (; node != nullptr && node_less(node, probe); node = balanced_tree::successor(node)) {
+                (node->m_tombstone ? tombstones : nodes).push_back(node);
+            }
+            if (node != nullptr && !node_greater(node, probe)) {
+                if (node->m_tombstone) {
+                    emplace_at(insert_point{nullptr, false, node}, std::move(*value));
+                }
+                continue;
+            }
+            created.push_back(create_node(std::move(*value)));
+            nodes.push_back(created.back());
+        }
+        for (; node != nullptr; node = balanced_tree::successor(node)) {
+            (node->m_tombstone ? tombstones : nodes).push_back(node);
+        }
+    } catch (...) {
+        for (auto fresh : created) {
+            destroy_node(fresh);
         }
-        balanced_tree::swap(node, leaf_node);
-        destroy_one(leaf_node);
-        balanced_tree::refresh_heights(sub_tree_root);
+        throw;
     }
+    for (auto tombstone : tombstones) {
+        destroy_node(tombstone);
+    }
+    m_lazy.m_tombstones = 0;
+    rebuild(nodes.data(), nodes.size());
 }
 
-template <typename T, typename Compare, typename Allocator>
-typename balanced_tree<T, Compare, Allocator>::bt_node const* balanced_tree<T, Compare, Allocator>::find(const bt_node* node, const value_type& value)
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::rebuild(bt_node* const* nodes, size_type count)
 {
-    if (node == nullptr) {
-        return nullptr;
-    }
-    if (!s_less_than(*node->m_value, value) &&
-            !s_less_than(value, *node->m_value)) {
-        return node;
-    } else if (s_less_than(*node->m_value, value)) {
-        return find(node->m_right_child, value);
-    } else {
-        return find(node->m_left_child, value);
+    // splitting at the middle leaves every empty child within one level of
+    // the others, red-black trees color the deepest level red
+    int red_depth = -1;
+    if (count > 1) {
+        red_depth = 0;
+        while ((size_type(2) << red_depth) <= count) {
+            ++red_depth;
+        }
     }
-    return nullptr;
+    m_head = build(nodes, count, nullptr, 0, red_depth);
+    m_size = count;
+    m_max = count != 0 ? nodes[count - 1] : nullptr;
 }
 
-template <typename T, typename Compare, typename Allocator>
-typename balanced_tree<T, Compare, Allocator>::bt_node* balanced_tree<T, Compare, Allocator>::find(bt_node* node, const value_type& value)
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::bt_node* balanced_tree<T, Compare, Allocator, Balance, Augment>::build(bt_node* const* nodes, size_type count, bt_node* parent, int depth, int red_depth)
 {
-    if (node == nullptr) {
+    if (count == 0) {
         return nullptr;
     }
-    if (!s_less_than(*node->m_value, value) &&
-            !s_less_than(value, *node->m_value)) {
-        return node;
-    } else if (s_less_than(*node->m_value, value)) {
-        return find(node->m_right_child, value);
+    const auto middle = count / 2;
+    auto node = nodes[middle];
+    node->m_parent = parent;
+    node->m_left_child = build(nodes, middle, node, depth + 1, red_depth);
+    node->m_right_child = build(nodes + middle + 1, count - middle - 1, node, depth + 1, red_depth);
+    balanced_tree::built_balance(node, depth == red_depth, Balance());
+    balanced_tree::summarize(node, unaugmented());
+    return node;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::link_node(bt_node* node, bt_node* parent, bool left)
+{
+    balanced_tree::init_balance(node, Balance());
+    node->m_parent = parent;
+    if (parent == nullptr) {
+        m_head = node;
+        m_max = node;
+    } else if (left) {
+        parent->m_left_child = node;
     } else {
-        return find(node->m_left_child, value);
+        parent->m_right_child = node;
+        if (parent == m_max) {
+            m_max = node;
+        }
     }
-    return nullptr;
+    ++m_size;
+    balanced_tree::summarize_path(node, unaugmented());
+    insert_fixup(node, Balance());
 }
 
-template <typename T, typename Compare, typename Allocator>
-void balanced_tree<T, Compare, Allocator>::left_rotate(balanced_tree* tree, bt_node* x)
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::unlink_node(bt_node* node)
 {
-    auto y = x->m_right_child;
-    if (y == nullptr) {
-        return;
+    if (node == m_max) {
+        m_max = balanced_tree::predecessor(node);
     }
-    x->m_right_child = y->m_left_child;
-    if (y->m_left_child != nullptr) {
-        y->m_left_child->m_parent = x;
-    }
-    y->m_parent = x->m_parent;
-    if (x->m_parent == nullptr) {
-        tree->m_head = y;
+    bt_node* child = nullptr;
+    bt_node* parent = nullptr;
+    balance_data removed;
+    if (node->m_left_child == nullptr || node->m_right_child == nullptr) {
+        child = node->m_left_child != nullptr ? node->m_left_child : node->m_right_child;
+        parent = node->m_parent;
+        removed = node->m_balance;
+        transplant(node, child);
     } else {
-        if (x->m_parent->m_left_child == x) {
-            x->m_parent->m_left_child = y;
+        // the successor takes the place of the node, the fixup starts where
+        // the successor was taken from
+        auto next = balanced_tree::min(node->m_right_child);
+        removed = next->m_balance;
+        child = next->m_right_child;
+        if (next->m_parent == node) {
+            parent = next;
         } else {
-            x->m_parent->m_right_child = y;
+            parent = next->m_parent;
+            transplant(next, child);
+            next->m_right_child = node->m_right_child;
+            next->m_right_child->m_parent = next;
         }
+        transplant(node, next);
+        next->m_left_child = node->m_left_child;
+        next->m_left_child->m_parent = next;
+        next->m_balance = node->m_balance;
     }
-    y->m_left_child = x;
-    x->m_parent = y;
+    node->m_left_child = nullptr;
+    node->m_right_child = nullptr;
+    node->m_parent = nullptr;
+    --m_size;
+    balanced_tree::summarize_path(parent, unaugmented());
+    erase_fixup(child, parent, removed, Balance());
 }
 
-template <typename T, typename Compare, typename Allocator>
-void balanced_tree<T, Compare, Allocator>::right_rotate(balanced_tree* tree, bt_node* y)
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::transplant(bt_node* node, bt_node* child)
 {
-    auto x = y->m_left_child;
-    if (x == nullptr) {
+    if (node->m_parent == nullptr) {
+        m_head = child;
+    } else if (node->m_parent->m_left_child == node) {
+        node->m_parent->m_left_child = child;
+    } else {
+        node->m_parent->m_right_child = child;
+    }
+    if (child != nullptr) {
+        child->m_parent = node->m_parent;
+    }
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+template <typename P>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::range_parts(const P& lo, const P& hi, std::vector<part>& parts) const
+{
+    // the same walk as aggregate, collecting the subtrees and single nodes
+    // the range is made of, in order
+    auto node = m_head;
+    while (node != nullptr) {
+        if (node_less(node, lo)) {
+            node = node->m_right_child;
+        } else if (node_greater(node, hi)) {
+            node = node->m_left_child;
+        } else {
+            break;
+        }
+    }
+    if (node == nullptr) {
         return;
     }
-    y->m_left_child = x->m_right_child;
-    if (x->m_right_child != nullptr) {
-        x->m_right_child->m_parent = y;
+    auto add = [&parts](bt_node* node, bool whole) {
+        if (node != nullptr) {
+            parts.push_back(part{node, whole, whole ? balanced_tree::subtree_size(node) : 1});
+        }
+    };
+    for (auto low = node->m_left_child; low != nullptr; ) {
+        if (node_less(low, lo)) {
+            low = low->m_right_child;
+        } else {
+            add(low->m_right_child, true);
+            add(low, false);
+            low = low->m_left_child;
+        }
     }
-    x->m_parent = y->m_parent;
-    if (y->m_parent == nullptr) {
-        tree->m_head = x;
-    } else {
-        if (y->m_parent->m_left_child == y) {
-            y->m_parent->m_left_child = x;
+    std::reverse(parts.begin(), parts.end());
+    add(node, false);
+    for (auto high = node->m_right_child; high != nullptr; ) {
+        if (node_greater(high, hi)) {
+            high = high->m_left_child;
         } else {
-            y->m_parent->m_right_child = x;
+            add(high->m_left_child, true);
+            add(high, false);
+            high = high->m_right_child;
         }
     }
-    x->m_right_child = y;
-    y->m_parent = x;
 }
 
-template <typename T, typename Compare, typename Allocator>
-std::pair<typename balanced_tree<T, Compare, Allocator>::iterator, bool> balanced_tree<T, Compare, Allocator>::insert(const value_type& value, balanced_tree* tree, bt_node* parent, bt_node* node)
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+std::vector<typename balanced_tree<T, Compare, Allocator, Balance, Augment>::const_range>
+balanced_tree<T, Compare, Allocator, Balance, Augment>::partition(std::vector<part>& parts, size_type pieces, bt_node* last) const
 {
-    std::pair<balanced_tree::iterator, bool> result;
-    if (node == nullptr) {
-        auto new_node = new bt_node(value);
-        if (parent != nullptr) {
-            new_node->m_parent = parent;
-            if (s_less_than(value, *parent->m_value)) {
-                parent->m_left_child = new_node;
-            } else {
-                parent->m_right_child = new_node;
-            }
-        } else {
-            tree->m_head = new_node;
+    // splits the subtrees larger than an eighth of a piece into their
+    // children and root, in order, then deals consecutive parts out to the
+    // pieces
+    pieces = std::max<size_type>(pieces, 1);
+    size_type estimate = 0;
+    for (const auto& piece : parts) {
+        estimate += piece.m_size;
+    }
+    const size_type threshold = std::max<size_type>(estimate / (8 * pieces), 1);
+    std::vector<part> split;
+    for (const auto& piece : parts) {
+        balanced_tree::split_parts(piece, threshold, split);
+    }
+    parts.swap(split);
+
+    size_type total = 0;
+    for (const auto& piece : parts) {
+        total += piece.m_size;
+    }
+    std::vector<const_range> ranges;
+    size_type done = 0;
+    size_type run = 0;
+    bt_node* first = nullptr;
+    for (size_type i = 0; i < parts.size(); ++i) {
+        if (first == nullptr) {
+            first = parts[i].m_whole ? balanced_tree::min(parts[i].m_node) : parts[i].m_node;
+        }
+        done += parts[i].m_size;
+        run += parts[i].m_size;
+        // cut at the boundary closest to the next multiple of total / pieces
+        const bool cut = i + 1 == parts.size() ||
+                         (2 * done + parts[i + 1].m_size) * pieces >= 2 * (ranges.size() + 1) * total;
+        if (!cut) {
+            continue;
+        }
+        bt_node* next = last;
+        if (i + 1 != parts.size()) {
+            next = parts[i + 1].m_whole ? balanced_tree::min(parts[i + 1].m_node) : parts[i + 1].m_node;
+        }
+        const_iterator begin{balanced_tree::skip_forward(first)};
+        const_iterator end{balanced_tree::skip_forward(next)};
+        if (begin != end) {
+            ranges.emplace_back(begin, end, run);
         }
-        return std::make_pair(iterator{new_node}, true);
+        first = nullptr;
+        run = 0;
     }
+    return ranges;
+}
 
-    if (!s_less_than(value, *node->m_value) &&
-        !s_less_than(*node->m_value, value)) {
-        return std::make_pair(iterator{node}, false);
-    } else if (s_less_than(value, *node->m_value)) {
-        result = insert(value, tree, node, node->m_left_child);
-    } else {
-        result = insert(value, tree, node, node->m_right_child);
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::split_parts(const part& piece, size_type threshold, std::vector<part>& parts)
+{
+    if (!piece.m_whole || piece.m_size <= threshold) {
+        parts.push_back(piece);
+        return;
     }
+    auto node = piece.m_node;
+    if (node->m_left_child != nullptr) {
+        split_parts(part{node->m_left_child, true, balanced_tree::subtree_size(node->m_left_child)}, threshold, parts);
+    }
+    parts.push_back(part{node, false, 1});
+    if (node->m_right_child != nullptr) {
+        split_parts(part{node->m_right_child, true, balanced_tree::subtree_size(node->m_right_child)}, threshold, parts);
+    }
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::size_type balanced_tree<T, Compare, Allocator, Balance, Augment>::subtree_size(const bt_node* node, avl_balance)
+{
+    // a subtree of height h, a leaf having 0, has between fib(h + 3) - 1 and
+    // 2^(h + 1) - 1 nodes
+    return (size_type(3) << std::min(node->m_balance, 61)) / 2;
+}
 
-    if (!result.second) {
-        return result;
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::size_type balanced_tree<T, Compare, Allocator, Balance, Augment>::subtree_size(const bt_node* node, red_black_balance)
+{
+    // estimated from the mean length of the two outer paths
+    int levels = 0;
+    for (auto left = node; left != nullptr; left = left->m_left_child) {
+        ++levels;
+    }
+    for (auto right = node; right != nullptr; right = right->m_right_child) {
+        ++levels;
     }
+    return size_type(1) << std::min(levels / 2, 62);
+}
 
-    auto node_parent = node->m_parent;
-    if (node_parent != nullptr) {
-        auto dir = balanced_tree::direction(node_parent);
-        if (dir > 0 && node_parent->m_right_child == node) {
-            if (balanced_tree::direction(node) < 0) {
-                balanced_tree::right_rotate(tree, node);
-                node = node_parent->m_right_child;
-            }
-            balanced_tree::left_rotate(tree, node_parent);
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::size_type balanced_tree<T, Compare, Allocator, Balance, Augment>::subtree_size(const bt_node* node, weight_balance)
+{
+    return node->m_balance;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::summary_data balanced_tree<T, Compare, Allocator, Balance, Augment>::value_summary(const bt_node* node)
+{
+    return node->m_tombstone ? Augment::identity() : Augment::make(*node->m_value);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::summary_data balanced_tree<T, Compare, Allocator, Balance, Augment>::subtree_summary(const bt_node* node)
+{
+    return node != nullptr ? node->summary() : Augment::identity();
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::summarize(bt_node* node, std::false_type)
+{
+    node->summary() = Augment::combine(Augment::combine(balanced_tree::subtree_summary(node->m_left_child),
+                                                        balanced_tree::value_summary(node)),
+                                       balanced_tree::subtree_summary(node->m_right_child));
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::summarize_path(bt_node* node, std::false_type)
+{
+    for (; node != nullptr; node = node->m_parent) {
+        balanced_tree::summarize(node, std::false_type());
+    }
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+template <typename P>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::summary_data balanced_tree<T, Compare, Allocator, Balance, Augment>::aggregate(const bt_node* node, const P& lo, const P& hi) const
+{
+    // descends to the first node within the range, below it the path to lo
+    // adds whole right subtrees and the path to hi whole left subtrees
+    while (node != nullptr) {
+        if (node_less(node, lo)) {
+            node = node->m_right_child;
+        } else if (node_greater(node, hi)) {
+            node = node->m_left_child;
+        } else {
+            break;
         }
-        if (dir < 0 && node_parent->m_left_child == node) {
-            if (balanced_tree::direction(node) > 0) {
-                balanced_tree::left_rotate(tree, node);
-                node = node_parent->m_left_child;
-            }
-            balanced_tree::right_rotate(tree, node_parent);
+    }
+    if (node == nullptr) {
+        return Augment::identity();
+    }
+    auto left = Augment::identity();
+    for (auto low = node->m_left_child; low != nullptr; ) {
+        if (node_less(low, lo)) {
+            low = low->m_right_child;
+        } else {
+            left = Augment::combine(Augment::combine(balanced_tree::value_summary(low),
+                                                     balanced_tree::subtree_summary(low->m_right_child)),
+                                    left);
+            low = low->m_left_child;
+        }
+    }
+    auto right = Augment::identity();
+    for (auto high = node->m_right_child; high != nullptr; ) {
+        if (node_greater(high, hi)) {
+            high = high->m_left_child;
+        } else {
+            right = Augment::combine(right,
+                                     Augment::combine(balanced_tree::subtree_summary(high->m_left_child),
+                                                      balanced_tree::value_summary(high)));
+            high = high->m_right_child;
         }
     }
+    return Augment::combine(Augment::combine(left, balanced_tree::value_summary(node)), right);
+}
 
-#define max(a, b) (((a) > (b)) ? (a) : (b))
-    node->m_height = 1 + max(balanced_tree::height(node->m_left_child),
-                             balanced_tree::height(node->m_right_child));
-    if (node_parent != nullptr) {
-        node_parent->m_height = 1 + max(balanced_tree::height(node_parent->m_left_child),
-                                        balanced_tree::height(node_parent->m_right_child));
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+template <typename Descend, typename Visit>
+bool balanced_tree<T, Compare, Allocator, Balance, Augment>::visit_pruned(const bt_node* node, Descend& descend, Visit& visit)
+{
+    if (node == nullptr || !descend(node->summary())) {
+        return true;
     }
-#undef max
+    if (!balanced_tree::visit_pruned(node->m_left_child, descend, visit)) {
+        return false;
+    }
+    if (!node->m_tombstone && !visit(*node->m_value)) {
+        return false;
+    }
+    return balanced_tree::visit_pruned(node->m_right_child, descend, visit);
+}
 
-    return result;
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::refresh(bt_node* node)
+{
+    balanced_tree::refresh(node, Balance());
+    balanced_tree::summarize(node, unaugmented());
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::refresh(bt_node* node, avl_balance)
+{
+    const auto left = balanced_tree::height(node->m_left_child);
+    const auto right = balanced_tree::height(node->m_right_child);
+    node->m_balance = 1 + (left > right ? left : right);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::refresh(bt_node* node, weight_balance)
+{
+    node->m_balance = balanced_tree::weight(node->m_left_child)
+                    + balanced_tree::weight(node->m_right_child) - 1;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::init_balance(bt_node* node, avl_balance)
+{
+    node->m_balance = 0;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::init_balance(bt_node* node, red_black_balance)
+{
+    node->m_balance = true;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::init_balance(bt_node* node, weight_balance)
+{
+    node->m_balance = 1;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::built_balance(bt_node* node, bool, avl_balance)
+{
+    balanced_tree::refresh(node, avl_balance());
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::built_balance(bt_node* node, bool bottom, red_black_balance)
+{
+    node->m_balance = bottom;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::built_balance(bt_node* node, bool, weight_balance)
+{
+    balanced_tree::refresh(node, weight_balance());
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::insert_fixup(bt_node* node, avl_balance)
+{
+    // stops as soon as a subtree keeps the height it had before the insert
+    auto parent = node->m_parent;
+    while (parent != nullptr) {
+        const auto old_height = parent->m_balance;
+        auto root = avl_rebalance(parent);
+        if (root->m_balance == old_height) {
+            break;
+        }
+        parent = root->m_parent;
+    }
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::erase_fixup(bt_node*, bt_node* parent, balance_data, avl_balance)
+{
+    while (parent != nullptr) {
+        parent = avl_rebalance(parent)->m_parent;
+    }
 }
 
-template <typename T, typename Compare, typename Allocator>
-int balanced_tree<T, Compare, Allocator>::height(const bt_node* node)
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+int balanced_tree<T, Compare, Allocator, Balance, Augment>::height(const bt_node* node)
 {
     if (node == nullptr) {
         return -1;
     } else {
-        return node->m_height;
+        return node->m_balance;
     }
 }
 
-template <typename T, typename Compare, typename Allocator>
-int balanced_tree<T, Compare, Allocator>::direction(const bt_node* node)
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+int balanced_tree<T, Compare, Allocator, Balance, Augment>::direction(const bt_node* node)
 {
     if (node == nullptr) {
         return 0;
@@ -827,38 +3062,273 @@ int balanced_tree<T, Compare, Allocator>::direction(const bt_node* node)
     }
 }
 
-template <typename T, typename Compare, typename Allocator>
-void balanced_tree<T, Compare, Allocator>::refresh_heights(bt_node* node)
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::bt_node* balanced_tree<T, Compare, Allocator, Balance, Augment>::avl_rebalance(bt_node* node)
 {
-    if (node == nullptr) {
+    balanced_tree::refresh(node, avl_balance());
+    const auto dir = balanced_tree::direction(node);
+    if (dir > 1) {
+        if (balanced_tree::direction(node->m_right_child) < 0) {
+            balanced_tree::right_rotate(this, node->m_right_child);
+        }
+        balanced_tree::left_rotate(this, node);
+        return node->m_parent;
+    }
+    if (dir < -1) {
+        if (balanced_tree::direction(node->m_left_child) > 0) {
+            balanced_tree::left_rotate(this, node->m_left_child);
+        }
+        balanced_tree::right_rotate(this, node);
+        return node->m_parent;
+    }
+    return node;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::insert_fixup(bt_node* node, red_black_balance)
+{
+    while (node != m_head && balanced_tree::is_red(node->m_parent)) {
+        auto parent = node->m_parent;
+        auto grand_parent = parent->m_parent;
+        if (parent == grand_parent->m_left_child) {
+            auto uncle = grand_parent->m_right_child;
+            if (balanced_tree::is_red(uncle)) {
+                parent->m_balance = false;
+                uncle->m_balance = false;
+                grand_parent->m_balance = true;
+                node = grand_parent;
+                continue;
+            }
+            if (node == parent->m_right_child) {
+                balanced_tree::left_rotate(this, parent);
+                parent = node;
+            }
+            parent->m_balance = false;
+            grand_parent->m_balance = true;
+            balanced_tree::right_rotate(this, grand_parent);
+        } else {
+            auto uncle = grand_parent->m_left_child;
+            if (balanced_tree::is_red(uncle)) {
+                parent->m_balance = false;
+                uncle->m_balance = false;
+                grand_parent->m_balance = true;
+                node = grand_parent;
+                continue;
+            }
+            if (node == parent->m_left_child) {
+                balanced_tree::right_rotate(this, parent);
+                parent = node;
+            }
+            parent->m_balance = false;
+            grand_parent->m_balance = true;
+            balanced_tree::left_rotate(this, grand_parent);
+        }
+        break;
+    }
+    m_head->m_balance = false;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::erase_fixup(bt_node* child, bt_node* parent, balance_data removed, red_black_balance)
+{
+    if (removed) {
         return;
     }
-    refresh_heights(node->m_left_child);
-    refresh_heights(node->m_right_child);
-#define max(a, b) (((a) > (b)) ? (a) : (b))
-    node->m_height = 1 + max(balanced_tree::height(node->m_left_child),
-                             balanced_tree::height(node->m_right_child));
-#undef max
+    while (child != m_head && !balanced_tree::is_red(child)) {
+        if (child == parent->m_left_child) {
+            auto sibling = parent->m_right_child;
+            if (balanced_tree::is_red(sibling)) {
+                sibling->m_balance = false;
+                parent->m_balance = true;
+                balanced_tree::left_rotate(this, parent);
+                sibling = parent->m_right_child;
+            }
+            if (!balanced_tree::is_red(sibling->m_left_child) &&
+                !balanced_tree::is_red(sibling->m_right_child)) {
+                sibling->m_balance = true;
+                child = parent;
+                parent = parent->m_parent;
+                continue;
+            }
+            if (!balanced_tree::is_red(sibling->m_right_child)) {
+                sibling->m_left_child->m_balance = false;
+                sibling->m_balance = true;
+                balanced_tree::right_rotate(this, sibling);
+                sibling = parent->m_right_child;
+            }
+            sibling->m_balance = parent->m_balance;
+            parent->m_balance = false;
+            sibling->m_right_child->m_balance = false;
+            balanced_tree::left_rotate(this, parent);
+        } else {
+            auto sibling = parent->m_left_child;
+            if (balanced_tree::is_red(sibling)) {
+                sibling->m_balance = false;
+                parent->m_balance = true;
+                balanced_tree::right_rotate(this, parent);
+                sibling = parent->m_left_child;
+            }
+            if (!balanced_tree::is_red(sibling->m_left_child) &&
+                !balanced_tree::is_red(sibling->m_right_child)) {
+                sibling->m_balance = true;
+                child = parent;
+                parent = parent->m_parent;
+                continue;
+            }
+            if (!balanced_tree::is_red(sibling->m_left_child)) {
+                sibling->m_right_child->m_balance = false;
+                sibling->m_balance = true;
+                balanced_tree::left_rotate(this, sibling);
+                sibling = parent->m_left_child;
+            }
+            sibling->m_balance = parent->m_balance;
+            parent->m_balance = false;
+            sibling->m_left_child->m_balance = false;
+            balanced_tree::right_rotate(this, parent);
+        }
+        child = m_head;
+    }
+    if (child != nullptr) {
+        child->m_balance = false;
+    }
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+bool balanced_tree<T, Compare, Allocator, Balance, Augment>::is_red(const bt_node* node)
+{
+    return node != nullptr && node->m_balance;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::insert_fixup(bt_node* node, weight_balance)
+{
+    auto parent = node->m_parent;
+    while (parent != nullptr) {
+        parent = weight_rebalance(parent)->m_parent;
+    }
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::erase_fixup(bt_node*, bt_node* parent, balance_data, weight_balance)
+{
+    while (parent != nullptr) {
+        parent = weight_rebalance(parent)->m_parent;
+    }
 }
 
-template <typename T, typename Compare, typename Allocator>
-void balanced_tree<T, Compare, Allocator>::swap(bt_node* src, bt_node* dest)
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::size_type balanced_tree<T, Compare, Allocator, Balance, Augment>::weight(const bt_node* node)
 {
-    const auto temp = *src->m_value;
-    *src->m_value = *dest->m_value;
-    *dest->m_value = temp;
+    return node == nullptr ? 1 : node->m_balance + 1;
 }
 
-template <typename T, typename Compare, typename Allocator>
-void balanced_tree<T, Compare, Allocator>::copy(const bt_node* src, bt_node*& dest, bt_node* parent)
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+typename balanced_tree<T, Compare, Allocator, Balance, Augment>::bt_node* balanced_tree<T, Compare, Allocator, Balance, Augment>::weight_rebalance(bt_node* node)
+{
+    // <3, 2> parameters of Hirai and Yamamoto, weight is the size plus one
+    const size_type delta = 3;
+    const size_type gamma = 2;
+    balanced_tree::refresh(node, weight_balance());
+    auto left = node->m_left_child;
+    auto right = node->m_right_child;
+    if (balanced_tree::weight(right) > delta * balanced_tree::weight(left)) {
+        if (balanced_tree::weight(right->m_left_child) >= gamma * balanced_tree::weight(right->m_right_child)) {
+            balanced_tree::right_rotate(this, right);
+        }
+        balanced_tree::left_rotate(this, node);
+        return node->m_parent;
+    }
+    if (balanced_tree::weight(left) > delta * balanced_tree::weight(right)) {
+        if (balanced_tree::weight(left->m_right_child) >= gamma * balanced_tree::weight(left->m_left_child)) {
+            balanced_tree::left_rotate(this, left);
+        }
+        balanced_tree::right_rotate(this, node);
+        return node->m_parent;
+    }
+    return node;
+}
+
+#ifdef BALANCED_TREE_STATS
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+size_t balanced_tree<T, Compare, Allocator, Balance, Augment>::path_length(const bt_node* node, size_t depth)
+{
+    if (node == nullptr) {
+        return 0;
+    }
+    return depth + path_length(node->m_left_child, depth + 1)
+                 + path_length(node->m_right_child, depth + 1);
+}
+#endif
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::copy(const bt_node* src, bt_node*& dest, bt_node* parent, unsigned threads)
+{
+    if (src == nullptr) {
+        return;
+    }
+    dest = create_node(*src->m_value);
+    dest->m_parent = parent;
+    dest->m_balance = src->m_balance;
+    dest->m_tombstone = src->m_tombstone;
+    dest->summary() = src->summary();
+    // the left half goes to a thread of its own when one can be started
+    auto node = dest;
+    std::future<void> left;
+    if (threads > 1) {
+        try {
+            left = std::async(std::launch::async, [this, src, node, threads] {
+                copy(src->m_left_child, node->m_left_child, node, threads / 2);
+            });
+        } catch (...) {
+        }
+    }
+    if (!left.valid()) {
+        copy(src->m_left_child, node->m_left_child, node);
+    }
+    // both halves always finish before an exception leaves, the caller then
+    // frees whatever part of the copy was built
+    try {
+        copy(src->m_right_child, node->m_right_child, node, threads - threads / 2);
+    } catch (...) {
+        if (left.valid()) {
+            left.wait();
+        }
+        throw;
+    }
+    if (left.valid()) {
+        left.get();
+    }
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void balanced_tree<T, Compare, Allocator, Balance, Augment>::move_values(bt_node* src, bt_node*& dest, bt_node* parent)
 {
     if (src == nullptr) {
         return;
     }
-    dest = new bt_node(*src->m_value);
+    dest = create_node(std::move(*src->m_value));
     dest->m_parent = parent;
-    copy(src->m_left_child, dest->m_left_child, dest);
-    copy(src->m_right_child, dest->m_right_child, dest);
+    dest->m_balance = src->m_balance;
+    dest->m_tombstone = src->m_tombstone;
+    dest->summary() = src->summary();
+    move_values(src->m_left_child, dest->m_left_child, dest);
+    move_values(src->m_right_child, dest->m_right_child, dest);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment>
+void swap(balanced_tree<T, Compare, Allocator, Balance, Augment>& lhs, balanced_tree<T, Compare, Allocator, Balance, Augment>& rhs)
+{
+    lhs.swap(rhs);
 }
 
+#if __cplusplus >= 201703L
+namespace pmr {
+
+template <typename T, typename Compare = std::less<T>, typename Balance = avl_balance,
+         typename Augment = no_augment>
+using balanced_tree = std::balanced_tree<T, Compare, std::pmr::polymorphic_allocator<T>, Balance, Augment>;
+
+} // namespace pmr
+#endif
+
 } // namespace std
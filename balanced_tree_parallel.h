@@ -0,0 +1,194 @@
+#pragma once
+
+#include <exception>
+#include <functional>
+#include <future>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "balanced_tree.h"
+
+namespace std {
+
+/*
+ * @brief default executor of the parallel algorithms, runs every task on a
+ *        thread of its own through std::async
+ *
+ * An executor is a callable taking a std::function<void()> and returning a
+ * handle whose get() waits for the task and rethrows what it threw, which is
+ * all a thread pool needs to provide:
+ *
+ *     struct pool_executor
+ *     {
+ *         thread_pool* m_pool;
+ *
+ *         std::future<void> operator() (std::function<void()> task) const
+ *         {
+ *             auto job = std::make_shared<std::packaged_task<void()> >(std::move(task));
+ *             auto done = job->get_future();
+ *             m_pool->submit([job] { (*job)(); });
+ *             return done;
+ *         }
+ *     };
+ *
+ *     auto ranges = tree.partition(4 * pool.size());
+ *     std::parallel_for_each(ranges, f, pool_executor{&pool});
+ *
+ * Cutting a few more pieces than there are workers lets the pool even out
+ * pieces of uneven cost. The ranges are a random access sequence, so they can
+ * also be handed to std::for_each(std::execution::par, ...).
+ */
+struct balanced_tree_async_executor
+{
+    std::future<void> operator() (std::function<void()> task) const
+    {
+        return std::async(std::launch::async, std::move(task));
+    }
+};
+
+namespace bt_detail {
+
+/*
+ * @brief number of pieces to split a tree of size elements into, small trees
+ *        are not worth a thread
+ */
+inline size_t default_pieces(size_t size)
+{
+    const size_t cutoff = 1 << 15;
+    return size < cutoff ? 1 : std::max(1u, std::thread::hardware_concurrency());
+}
+
+/*
+ * @brief runs body(i) for every piece, the first one on the calling thread,
+ *        and rethrows the first exception once all pieces are done
+ */
+template <typename Body, typename Executor>
+void run_pieces(size_t count, const Body& body, Executor& executor)
+{
+    if (count == 0) {
+        return;
+    }
+    typedef decltype(executor(std::function<void()>())) handle_type;
+    std::vector<handle_type> handles;
+    handles.reserve(count - 1);
+    std::exception_ptr error;
+    try {
+        for (size_t i = 1; i < count; ++i) {
+            handles.push_back(executor([&body, i] {
+                body(i);
+            }));
+        }
+        body(0);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    for (auto& handle : handles) {
+        try {
+            handle.get();
+        } catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+} // namespace bt_detail
+
+/*
+ * @brief calls f on every element of the ranges, one task per range
+ *
+ * f is shared by the tasks and must allow concurrent calls.
+ */
+template <typename Range, typename Function, typename Executor = balanced_tree_async_executor>
+void parallel_for_each(const std::vector<Range>& ranges, Function f, Executor executor = Executor())
+{
+    bt_detail::run_pieces(ranges.size(), [&ranges, &f](size_t i) {
+        for (const auto& value : ranges[i]) {
+            f(value);
+        }
+    }, executor);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment, typename Function>
+void parallel_for_each(const balanced_tree<T, Compare, Allocator, Balance, Augment>& tree, Function f)
+{
+    parallel_for_each(tree.partition(bt_detail::default_pieces(tree.size())), f);
+}
+
+/*
+ * @brief combines transform(value) of all elements of the ranges with
+ *        reduce, in order, starting from init
+ *
+ * reduce must be associative, it need not be commutative. Each range is
+ * folded on its own task and the results are combined on the calling thread.
+ */
+template <typename Range, typename R, typename Reduce, typename Transform,
+         typename Executor = balanced_tree_async_executor>
+R parallel_reduce(const std::vector<Range>& ranges, R init, Reduce reduce, Transform transform,
+                  Executor executor = Executor())
+{
+    std::vector<R> partials(ranges.size(), init);
+    std::vector<char> folded(ranges.size(), false);
+    bt_detail::run_pieces(ranges.size(), [&](size_t i) {
+        auto iter = ranges[i].begin();
+        const auto end = ranges[i].end();
+        if (iter == end) {
+            return;
+        }
+        R partial = transform(*iter);
+        for (++iter; iter != end; ++iter) {
+            partial = reduce(std::move(partial), transform(*iter));
+        }
+        partials[i] = std::move(partial);
+        folded[i] = true;
+    }, executor);
+    for (size_t i = 0; i < partials.size(); ++i) {
+        if (folded[i]) {
+            init = reduce(std::move(init), std::move(partials[i]));
+        }
+    }
+    return init;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment,
+         typename R, typename Reduce, typename Transform>
+R parallel_reduce(const balanced_tree<T, Compare, Allocator, Balance, Augment>& tree,
+                  R init, Reduce reduce, Transform transform)
+{
+    return parallel_reduce(tree.partition(bt_detail::default_pieces(tree.size())),
+                           std::move(init), reduce, transform);
+}
+
+/*
+ * @brief returns the number of elements of the ranges satisfying pred
+ */
+template <typename Range, typename Predicate, typename Executor = balanced_tree_async_executor>
+size_t parallel_count_if(const std::vector<Range>& ranges, Predicate pred, Executor executor = Executor())
+{
+    std::vector<size_t> counts(ranges.size(), 0);
+    bt_detail::run_pieces(ranges.size(), [&](size_t i) {
+        size_t count = 0;
+        for (const auto& value : ranges[i]) {
+            count += pred(value) ? 1 : 0;
+        }
+        counts[i] = count;
+    }, executor);
+    size_t total = 0;
+    for (const auto count : counts) {
+        total += count;
+    }
+    return total;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance, typename Augment, typename Predicate>
+size_t parallel_count_if(const balanced_tree<T, Compare, Allocator, Balance, Augment>& tree, Predicate pred)
+{
+    return parallel_count_if(tree.partition(bt_detail::default_pieces(tree.size())), pred);
+}
+
+} // namespace std
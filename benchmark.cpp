@@ -0,0 +1,738 @@
+/*
+ * benchmarks for balanced_tree
+ *
+ * g++ -std=c++17 -O2 -pthread benchmark.cpp -o benchmark && ./benchmark [size] [name]
+ */
+#define BALANCED_TREE_STATS
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "balanced_tree.h"
+#include "balanced_map.h"
+#include "balanced_tree_parallel.h"
+#include "concurrent_balanced_tree.h"
+
+namespace bench {
+
+// keeps lookups from being optimised away
+volatile size_t sink = 0;
+
+class timer
+{
+public:
+    timer()
+        : m_start(std::chrono::steady_clock::now())
+    {}
+
+    double seconds() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point m_start;
+};
+
+void report(const std::string& name, const std::string& workload, size_t ops, double seconds)
+{
+    std::cout << std::left << std::setw(14) << name
+              << std::setw(14) << workload
+              << std::right << std::setw(10) << std::fixed << std::setprecision(1)
+              << seconds * 1e9 / ops << " ns/op";
+}
+
+enum class workload
+{
+    random_mixed,   // 50% insert, 25% erase, 25% find over random keys
+    write_heavy,    // 50% insert, 50% erase over random keys
+    sliding_window  // append ascending keys, erase the oldest one
+};
+
+const char* workload_name(workload kind)
+{
+    switch (kind) {
+    case workload::random_mixed:
+        return "random-mixed";
+    case workload::write_heavy:
+        return "write-heavy";
+    default:
+        return "sliding";
+    }
+}
+
+template <typename Balance>
+void balancing(const std::string& name, workload kind, size_t size)
+{
+    std::balanced_tree<int, std::less<int>, std::allocator<int>, Balance> tree;
+    std::mt19937 random(42);
+    for (size_t i = 0; i < size; ++i) {
+        tree.insert(kind == workload::sliding_window ? static_cast<int>(i)
+                                                     : static_cast<int>(random() % (2 * size)));
+    }
+    const auto warm_rotations = tree.rotations();
+
+    const size_t ops = 2 * size;
+    size_t updates = 0;
+    size_t found = 0;
+    timer clock;
+    for (size_t i = 0; i < ops; ++i) {
+        const int key = static_cast<int>(random() % (2 * size));
+        switch (kind) {
+        case workload::random_mixed:
+            if (i % 4 < 2) {
+                tree.insert(key);
+                ++updates;
+            } else if (i % 4 == 2) {
+                tree.erase(key);
+                ++updates;
+            } else {
+                found += tree.find(key) != tree.end();
+            }
+            break;
+        case workload::write_heavy:
+            if (i % 2 == 0) {
+                tree.insert(key);
+            } else {
+                tree.erase(key);
+            }
+            ++updates;
+            break;
+        case workload::sliding_window:
+            tree.insert(static_cast<int>(size + i));
+            tree.erase(tree.begin());
+            updates += 2;
+            break;
+        }
+    }
+    const auto elapsed = clock.seconds();
+
+    report(name, workload_name(kind), ops, elapsed);
+    std::cout << std::setw(10) << std::setprecision(3)
+              << double(tree.rotations() - warm_rotations) / updates << " rot/update"
+              << std::setw(8) << std::setprecision(2)
+              << double(tree.path_length()) / tree.size() << " avg depth" << std::endl;
+    sink = sink + found;
+}
+
+void balancing_policies(size_t size)
+{
+    std::cout << "balancing policies, " << size << " elements" << std::endl;
+    for (auto kind : {workload::random_mixed, workload::write_heavy, workload::sliding_window}) {
+        balancing<std::avl_balance>("avl", kind, size);
+        balancing<std::red_black_balance>("red-black", kind, size);
+        balancing<std::weight_balance>("weight", kind, size);
+    }
+}
+
+struct large_value
+{
+    char m_payload[512];
+};
+
+template <bool InlineKeys>
+void map_lookup(const std::string& name, size_t size)
+{
+    std::balanced_map<unsigned long, large_value, std::less<unsigned long>,
+                      std::allocator<std::pair<const unsigned long, large_value> >,
+                      std::avl_balance, InlineKeys> map;
+    std::mt19937_64 random(42);
+    std::vector<unsigned long> keys(size);
+    for (auto& key : keys) {
+        key = random();
+        map.try_emplace(key);
+    }
+    std::shuffle(keys.begin(), keys.end(), random);
+
+    size_t found = 0;
+    timer clock;
+    for (const auto& key : keys) {
+        found += map.find(key) != map.end();
+    }
+    report(name, "find", keys.size(), clock.seconds());
+    std::cout << std::endl;
+    sink = sink + found;
+}
+
+void map_storage(size_t size)
+{
+    std::cout << "balanced_map with 512 byte values, " << size << " elements" << std::endl;
+    map_lookup<false>("pair-nodes", size);
+    map_lookup<true>("inline-keys", size);
+}
+
+struct counting_less
+{
+    explicit counting_less(size_t* counter = nullptr)
+        : m_counter(counter)
+    {}
+
+    bool operator() (long lhs, long rhs) const
+    {
+        ++*m_counter;
+        return lhs < rhs;
+    }
+
+    size_t* m_counter;
+};
+
+enum class insertion
+{
+    plain,
+    hint_end,
+    hint_last
+};
+
+void near_sorted(const std::string& name, insertion kind, const std::vector<long>& keys)
+{
+    size_t comparisons = 0;
+    std::balanced_tree<long, counting_less> tree{counting_less(&comparisons)};
+    auto last = tree.end();
+    timer clock;
+    for (const auto key : keys) {
+        switch (kind) {
+        case insertion::plain:
+            tree.insert(key);
+            break;
+        case insertion::hint_end:
+            tree.insert(tree.end(), key);
+            break;
+        case insertion::hint_last:
+            last = tree.insert(last, key);
+            break;
+        }
+    }
+    report(name, "insert", keys.size(), clock.seconds());
+    std::cout << std::setw(10) << std::setprecision(2)
+              << double(comparisons) / keys.size() << " cmp/op" << std::endl;
+}
+
+void near_sorted_insert(size_t size)
+{
+    // timestamps arriving mostly in order, one in eight is late by up to 64
+    std::mt19937 random(42);
+    std::vector<long> ascending(size);
+    std::vector<long> jittered(size);
+    for (size_t i = 0; i < size; ++i) {
+        ascending[i] = static_cast<long>(i) * 100;
+        jittered[i] = ascending[i] - (random() % 8 == 0 ? (random() % 64) * 100 + 50 : 0);
+    }
+    std::cout << "ascending keys, " << size << " elements" << std::endl;
+    near_sorted("plain", insertion::plain, ascending);
+    near_sorted("hint-end", insertion::hint_end, ascending);
+    std::cout << "nearly ascending keys, " << size << " elements" << std::endl;
+    near_sorted("plain", insertion::plain, jittered);
+    near_sorted("hint-end", insertion::hint_end, jittered);
+    near_sorted("hint-last", insertion::hint_last, jittered);
+}
+
+void batch_load(size_t size)
+{
+    // a batch of a fifth of the tree size, the ratio of the hourly loads
+    std::mt19937_64 random(42);
+    std::vector<unsigned long> initial(size);
+    std::vector<unsigned long> batch(size / 5);
+    for (auto& key : initial) {
+        key = random();
+    }
+    for (auto& key : batch) {
+        key = random();
+    }
+    std::cout << "batch of " << batch.size() << " into " << size << " elements" << std::endl;
+    {
+        std::balanced_tree<unsigned long> tree(initial.begin(), initial.end());
+        timer clock;
+        for (const auto key : batch) {
+            tree.insert(key);
+        }
+        report("one-by-one", "insert", batch.size(), clock.seconds());
+        std::cout << std::endl;
+    }
+    {
+        std::balanced_tree<unsigned long> tree(initial.begin(), initial.end());
+        timer clock;
+        tree.insert(batch.begin(), batch.end());
+        report("range", "insert", batch.size(), clock.seconds());
+        std::cout << std::endl;
+    }
+}
+
+void churn(const std::string& name, bool lazy, size_t size)
+{
+    // erase a window of keys, then put most of them back
+    std::balanced_tree<int> tree;
+    for (size_t i = 0; i < size; ++i) {
+        tree.insert(static_cast<int>(i));
+    }
+    tree.set_lazy_erase(lazy);
+    std::mt19937 random(42);
+    const size_t window = 1024;
+    std::vector<int> keys(window);
+    double erase_time = 0;
+    double insert_time = 0;
+    size_t ops = 0;
+    for (size_t round = 0; round < size / window; ++round) {
+        for (auto& key : keys) {
+            key = static_cast<int>(random() % size);
+        }
+        timer erase_clock;
+        for (const auto key : keys) {
+            tree.erase(key);
+        }
+        erase_time += erase_clock.seconds();
+        timer insert_clock;
+        for (size_t i = 0; i < window * 7 / 8; ++i) {
+            tree.insert(keys[i]);
+        }
+        insert_time += insert_clock.seconds();
+        ops += window;
+    }
+    report(name, "erase", ops, erase_time);
+    std::cout << std::endl;
+    report(name, "reinsert", ops * 7 / 8, insert_time);
+    std::cout << std::endl;
+}
+
+void lazy_erase(size_t size)
+{
+    std::cout << "erase and reinsert churn, " << size << " elements" << std::endl;
+    churn("eager", false, size);
+    churn("lazy", true, size);
+}
+
+// same order as std::less<std::string>, but without the prefix cache
+struct plain_string_less
+{
+    bool operator() (const std::string& lhs, const std::string& rhs) const
+    {
+        return lhs < rhs;
+    }
+};
+
+template <typename Compare>
+void string_lookup(const std::string& name, const std::string& workload,
+                   const std::vector<std::string>& keys)
+{
+    std::balanced_tree<std::string, Compare> tree(keys.begin(), keys.end());
+    std::vector<std::string> probes(keys);
+    std::shuffle(probes.begin(), probes.end(), std::mt19937(42));
+
+    size_t found = 0;
+    timer clock;
+    for (const auto& key : probes) {
+        found += tree.find(key) != tree.end();
+    }
+    report(name, workload, probes.size(), clock.seconds());
+    std::cout << std::endl;
+    sink = sink + found;
+}
+
+void string_keys(size_t size)
+{
+    std::mt19937_64 random(42);
+    const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    std::vector<std::string> identifiers(size);
+    std::vector<std::string> urls(size);
+    for (size_t i = 0; i < size; ++i) {
+        for (int c = 0; c < 24; ++c) {
+            identifiers[i] += digits[random() % 36];
+        }
+        urls[i] = "shop" + std::to_string(random() % 1000) + ".example.com/items/" + std::to_string(random());
+    }
+    std::cout << "string keys, " << size << " elements" << std::endl;
+    string_lookup<plain_string_less>("plain", "identifier", identifiers);
+    string_lookup<std::less<std::string> >("prefix", "identifier", identifiers);
+    string_lookup<plain_string_less>("plain", "url", urls);
+    string_lookup<std::less<std::string> >("prefix", "url", urls);
+}
+
+// orders strings and counts its calls, the compare member is only offered
+// with Compare3 so that the tree falls back to two-way searches without it
+template <bool Compare3>
+struct counting_string_less
+{
+    explicit counting_string_less(size_t* counter = nullptr)
+        : m_counter(counter)
+    {}
+
+    bool operator() (const std::string& lhs, const std::string& rhs) const
+    {
+        ++*m_counter;
+        return lhs < rhs;
+    }
+
+    template <bool Enable = Compare3, typename = typename std::enable_if<Enable>::type>
+    int compare(const std::string& lhs, const std::string& rhs) const
+    {
+        ++*m_counter;
+        return lhs.compare(rhs);
+    }
+
+    size_t* m_counter;
+};
+
+template <bool Compare3>
+void search_cost(const std::string& name, const std::vector<std::string>& keys)
+{
+    size_t comparisons = 0;
+    std::balanced_tree<std::string, counting_string_less<Compare3> >
+        tree(keys.begin(), keys.end(), counting_string_less<Compare3>(&comparisons));
+    std::vector<std::string> probes(keys);
+    std::shuffle(probes.begin(), probes.end(), std::mt19937(42));
+
+    comparisons = 0;
+    size_t found = 0;
+    timer clock;
+    for (const auto& key : probes) {
+        found += tree.find(key) != tree.end();
+    }
+    report(name, "find", probes.size(), clock.seconds());
+    std::cout << std::setw(10) << std::setprecision(2)
+              << double(comparisons) / probes.size() << " cmp/op" << std::endl;
+    sink = sink + found;
+}
+
+void three_way_search(size_t size)
+{
+    // composite keys sharing a long prefix make every comparison expensive
+    std::mt19937_64 random(42);
+    std::vector<std::string> keys(size);
+    for (auto& key : keys) {
+        key = "tenant/0042/orders/" + std::to_string(random());
+    }
+    std::cout << "string keys with a shared prefix, " << size << " elements" << std::endl;
+    search_cost<false>("two-way", keys);
+    search_cost<true>("three-way", keys);
+}
+
+// std::allocator without the thread-safe mark, copies and frees serially
+template <typename T>
+struct serial_allocator
+    : std::allocator<T>
+{
+    template <typename U>
+    struct rebind
+    {
+        typedef serial_allocator<U> other;
+    };
+
+    serial_allocator() = default;
+
+    template <typename U>
+    serial_allocator(const serial_allocator<U>&)
+    {}
+};
+
+template <typename Allocator>
+void copy_and_clear(const std::string& name, size_t size)
+{
+    std::vector<unsigned long> keys(size);
+    std::mt19937_64 random(42);
+    for (auto& key : keys) {
+        key = random();
+    }
+    std::balanced_tree<unsigned long, std::less<unsigned long>, Allocator> tree(keys.begin(), keys.end());
+
+    timer copy_clock;
+    auto copy = tree;
+    report(name, "copy", size, copy_clock.seconds());
+    std::cout << std::endl;
+
+    timer clear_clock;
+    copy.clear();
+    report(name, "clear", size, clear_clock.seconds());
+    std::cout << std::endl;
+
+    timer async_clock;
+    tree.clear_async();
+    const auto elapsed = async_clock.seconds();
+    std::cout << std::left << std::setw(14) << name << std::setw(14) << "clear_async"
+              << std::right << std::setw(10) << std::setprecision(1) << elapsed * 1e6 << " us" << std::endl;
+}
+
+void teardown(size_t size)
+{
+    std::cout << "copy and clear, " << size << " elements" << std::endl;
+    copy_and_clear<serial_allocator<unsigned long> >("serial", size);
+    copy_and_clear<std::allocator<unsigned long> >("parallel", size);
+}
+
+struct volume_sum
+{
+    typedef unsigned long summary_type;
+
+    static unsigned long identity()
+    {
+        return 0;
+    }
+
+    static unsigned long make(unsigned long price)
+    {
+        return price % 1000;
+    }
+
+    static unsigned long combine(unsigned long lhs, unsigned long rhs)
+    {
+        return lhs + rhs;
+    }
+};
+
+void range_sums(size_t size)
+{
+    // total volume of the orders priced within a window of about 1% of them
+    std::mt19937_64 random(42);
+    std::vector<unsigned long> prices(size);
+    for (auto& price : prices) {
+        price = random() % (100 * size);
+    }
+    std::cout << "range sums over 1% of " << size << " elements" << std::endl;
+    {
+        std::balanced_tree<unsigned long> tree;
+        timer clock;
+        for (const auto price : prices) {
+            tree.insert(price);
+        }
+        report("plain", "insert", size, clock.seconds());
+        std::cout << std::endl;
+
+        const size_t queries = 10000;
+        unsigned long total = 0;
+        timer query_clock;
+        for (size_t i = 0; i < queries; ++i) {
+            const auto low = random() % (99 * size);
+            const auto end = tree.upper_bound(low + size);
+            for (auto iter = tree.lower_bound(low); iter != end; ++iter) {
+                total += *iter % 1000;
+            }
+        }
+        report("plain", "iterate", queries, query_clock.seconds());
+        std::cout << std::endl;
+        sink = sink + total;
+    }
+    {
+        std::balanced_tree<unsigned long, std::less<unsigned long>, std::allocator<unsigned long>,
+                           std::avl_balance, volume_sum> tree;
+        timer clock;
+        for (const auto price : prices) {
+            tree.insert(price);
+        }
+        report("augmented", "insert", size, clock.seconds());
+        std::cout << std::endl;
+
+        const size_t queries = 10000;
+        unsigned long total = 0;
+        timer query_clock;
+        for (size_t i = 0; i < queries; ++i) {
+            const auto low = random() % (99 * size);
+            total += tree.aggregate(low, low + size);
+        }
+        report("augmented", "aggregate", queries, query_clock.seconds());
+        std::cout << std::endl;
+        sink = sink + total;
+    }
+}
+
+void locality(const std::string& name, const std::balanced_tree<unsigned long>& tree,
+              const std::vector<unsigned long>& probes)
+{
+    size_t found = 0;
+    timer find_clock;
+    for (const auto key : probes) {
+        found += tree.find(key) != tree.end();
+    }
+    report(name, "find", probes.size(), find_clock.seconds());
+    std::cout << std::endl;
+
+    unsigned long total = 0;
+    timer scan_clock;
+    for (const auto value : tree) {
+        total += value;
+    }
+    report(name, "scan", tree.size(), scan_clock.seconds());
+    std::cout << std::endl;
+    sink = sink + found + total;
+}
+
+void relayout(size_t size)
+{
+    // months of churn in short: twice the final size inserted in random order
+    // with every other key erased again
+    std::mt19937_64 random(42);
+    std::balanced_tree<unsigned long> tree;
+    std::vector<unsigned long> keys(2 * size);
+    for (auto& key : keys) {
+        key = random();
+        tree.insert(key);
+    }
+    std::shuffle(keys.begin(), keys.end(), random);
+    for (size_t i = 0; i < keys.size(); i += 2) {
+        tree.erase(keys[i]);
+    }
+    std::vector<unsigned long> probes(keys.begin(), keys.begin() + std::min(keys.size(), size_t(1000000)));
+    std::shuffle(probes.begin(), probes.end(), random);
+
+    std::cout << "churned tree of " << tree.size() << " elements" << std::endl;
+    locality("churned", tree, probes);
+    const std::pair<const char*, std::balanced_tree_layout> orders[] = {
+        {"in-order", std::balanced_tree_layout::in_order},
+        {"bfs", std::balanced_tree_layout::breadth_first},
+        {"veb", std::balanced_tree_layout::van_emde_boas}};
+    for (const auto& order : orders) {
+        timer clock;
+        tree.relayout(order.second);
+        report(order.first, "relayout", tree.size(), clock.seconds());
+        std::cout << std::endl;
+        locality(order.first, tree, probes);
+    }
+    tree.relayout(std::balanced_tree_layout::van_emde_boas, true);
+    locality("veb-huge", tree, probes);
+}
+
+void parallel_scan(size_t size)
+{
+    std::mt19937_64 random(42);
+    std::vector<unsigned long> keys(size);
+    for (auto& key : keys) {
+        key = random();
+    }
+    std::balanced_tree<unsigned long> tree(keys.begin(), keys.end());
+    const auto weight = [](unsigned long key) {
+        return key % 1000;
+    };
+    std::cout << "scan of " << tree.size() << " elements on "
+              << std::thread::hardware_concurrency() << " threads" << std::endl;
+
+    timer serial_clock;
+    unsigned long serial = 0;
+    for (const auto key : tree) {
+        serial += weight(key);
+    }
+    report("serial", "sum", tree.size(), serial_clock.seconds());
+    std::cout << std::endl;
+
+    timer partition_clock;
+    const auto ranges = tree.partition(std::max(1u, std::thread::hardware_concurrency()));
+    report("parallel", "partition", 1, partition_clock.seconds());
+    std::cout << std::endl;
+
+    timer parallel_clock;
+    const auto parallel = std::parallel_reduce(ranges, 0UL, std::plus<unsigned long>(), weight);
+    report("parallel", "sum", tree.size(), parallel_clock.seconds());
+    std::cout << std::endl;
+    sink = sink + serial + parallel;
+}
+
+// one balanced_tree behind a plain mutex, the baseline for flat combining
+class locked_tree
+{
+public:
+    bool insert(unsigned long key)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_tree.insert(key).second;
+    }
+
+    size_t erase(unsigned long key)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_tree.erase(key);
+    }
+
+private:
+    std::mutex m_mutex;
+    std::balanced_tree<unsigned long> m_tree;
+};
+
+template <typename Tree>
+void writers(const std::string& name, unsigned threads, size_t size)
+{
+    // every thread inserts random keys and erases them again half the time,
+    // keeping the tree at about size elements
+    Tree tree;
+    const size_t ops = 2 * size;
+    std::vector<std::thread> workers;
+    timer clock;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&tree, t, threads, ops] {
+            std::mt19937_64 random(t);
+            for (size_t i = t; i < ops; i += threads) {
+                const auto key = random() % (2 * ops);
+                if (i % 4 == 3) {
+                    tree.erase(key);
+                } else {
+                    tree.insert(key);
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    report(name, std::to_string(threads) + " threads", ops, clock.seconds());
+    std::cout << std::endl;
+}
+
+void concurrent_writers(size_t size)
+{
+    std::cout << "concurrent inserts and erases, " << std::thread::hardware_concurrency()
+              << " hardware threads" << std::endl;
+    for (unsigned threads = 1; threads <= 16; threads *= 2) {
+        writers<locked_tree>("mutex", threads, size);
+        writers<std::concurrent_balanced_tree<unsigned long> >("combining", threads, size);
+    }
+}
+
+} // namespace bench
+
+int main(int argc, char** argv)
+{
+    const size_t size = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+    const std::string only = argc > 2 ? argv[2] : "";
+    auto selected = [&only](const std::string& name) {
+        return only.empty() || only == name;
+    };
+    if (selected("balancing")) {
+        bench::balancing_policies(size);
+    }
+    if (selected("map")) {
+        bench::map_storage(size);
+    }
+    if (selected("near-sorted")) {
+        bench::near_sorted_insert(size);
+    }
+    if (selected("batch")) {
+        bench::batch_load(size);
+    }
+    if (selected("lazy")) {
+        bench::lazy_erase(size);
+    }
+    if (selected("strings")) {
+        bench::string_keys(size);
+    }
+    if (selected("three-way")) {
+        bench::three_way_search(size);
+    }
+    if (selected("teardown")) {
+        bench::teardown(size);
+    }
+    if (selected("aggregate")) {
+        bench::range_sums(size);
+    }
+    if (selected("relayout")) {
+        bench::relayout(size);
+    }
+    if (selected("parallel")) {
+        bench::parallel_scan(size);
+    }
+    if (selected("writers")) {
+        bench::concurrent_writers(size);
+    }
+}
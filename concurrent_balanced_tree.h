@@ -0,0 +1,310 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "balanced_tree.h"
+
+namespace std {
+
+/*
+ * @brief balanced_tree shared by many writers through flat combining
+ *
+ * A thread does not lock the tree for its operation. It publishes the
+ * operation in a slot and waits. Whichever waiting thread takes the combiner
+ * lock collects all published operations, sorts them by value and applies
+ * them to the tree in that order, each insert starting from the position of
+ * the previous one, then hands every thread its result. The tree and its
+ * upper levels stay in the cache of one thread at a time and a batch costs
+ * one lock hand-off instead of one per operation.
+ *
+ * Threads pick their slot by a hash of their id, so a thread keeps hitting
+ * the same cache line. Operations published at the same time are concurrent,
+ * so applying them in value order is linearizable. Exceptions thrown while
+ * applying an operation are rethrown in the thread that published it, one
+ * thrown while sorting a batch in every thread of the batch.
+ */
+template <typename T,
+         typename Compare = std::less<T>,
+         typename Allocator = std::allocator<T>,
+         typename Balance = avl_balance>
+class concurrent_balanced_tree
+{
+public:
+    typedef T value_type;
+    typedef size_t size_type;
+    typedef Compare value_compare;
+    typedef Allocator allocator_type;
+    typedef balanced_tree<T, Compare, Allocator, Balance> tree_type;
+
+private:
+    enum class operation
+    {
+        insert,
+        erase,
+        contains
+    };
+
+    enum slot_state : int
+    {
+        idle,
+        claimed,
+        pending,
+        done
+    };
+
+    struct alignas(64) slot
+    {
+        std::atomic<int> m_state{idle};
+        operation m_operation{operation::contains};
+        const value_type* m_value{nullptr};
+        value_type* m_movable{nullptr};
+        bool m_result{false};
+        std::exception_ptr m_error;
+    };
+
+    // @{public interfaces
+public:
+    explicit concurrent_balanced_tree(const Compare& comp = Compare(), const Allocator& alloc = Allocator())
+        : m_tree(comp, alloc)
+        , m_slot_count(std::max(16u, 4 * std::thread::hardware_concurrency()))
+        , m_storage(new unsigned char[m_slot_count * sizeof(slot) + alignof(slot)])
+        , m_slots(make_slots())
+        , m_size(0)
+    {
+        m_batch.reserve(m_slot_count);
+        m_order.reserve(m_slot_count);
+    }
+
+    ~concurrent_balanced_tree()
+    {
+        for (unsigned i = 0; i < m_slot_count; ++i) {
+            m_slots[i].~slot();
+        }
+    }
+
+    concurrent_balanced_tree(const concurrent_balanced_tree&) = delete;
+    concurrent_balanced_tree& operator= (const concurrent_balanced_tree&) = delete;
+
+public:
+    /*
+     * @brief inserts value, returns false when an equal value is present
+     */
+    bool insert(const value_type& value)
+    {
+        return publish(operation::insert, value, nullptr);
+    }
+
+    bool insert(value_type&& value)
+    {
+        return publish(operation::insert, value, &value);
+    }
+
+    /*
+     * @brief erases the value equal to value, returns 1 if there was one
+     */
+    size_type erase(const value_type& value)
+    {
+        return publish(operation::erase, value, nullptr) ? 1 : 0;
+    }
+
+    /*
+     * @brief returns true if a value equal to value is present
+     */
+    bool contains(const value_type& value)
+    {
+        return publish(operation::contains, value, nullptr);
+    }
+
+    /*
+     * @brief number of values after the last applied batch
+     */
+    size_type size() const noexcept
+    {
+        return m_size.load(std::memory_order_acquire);
+    }
+
+    bool empty() const noexcept
+    {
+        return size() == 0;
+    }
+
+    /*
+     * @brief calls f with the tree while holding the combiner lock, for
+     *        iteration, range queries and other bulk reads
+     */
+    template <typename Function>
+    void visit(Function f)
+    {
+        std::lock_guard<std::mutex> lock(m_combiner);
+        f(static_cast<const tree_type&>(m_tree));
+    }
+    // @}
+
+private:
+    slot* make_slots();
+    bool publish(operation op, const value_type& value, value_type* movable);
+    slot& claim_slot();
+    void combine();
+    template <typename V>
+    typename tree_type::const_iterator insert(V&& value, typename tree_type::const_iterator hint, bool hinted, bool& inserted);
+
+private:
+    tree_type m_tree;
+    const unsigned m_slot_count;
+    std::unique_ptr<unsigned char[]> m_storage;
+    slot* m_slots;
+    std::atomic<size_type> m_size;
+    std::mutex m_combiner;
+    std::vector<slot*> m_batch;
+    std::vector<slot*> m_order;
+};
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename concurrent_balanced_tree<T, Compare, Allocator, Balance>::slot* concurrent_balanced_tree<T, Compare, Allocator, Balance>::make_slots()
+{
+    // new[] honours the cache line alignment of slot only since C++17
+    void* memory = m_storage.get();
+    size_t space = m_slot_count * sizeof(slot) + alignof(slot);
+    auto slots = static_cast<slot*>(std::align(alignof(slot), m_slot_count * sizeof(slot), memory, space));
+    for (unsigned i = 0; i < m_slot_count; ++i) {
+        new (slots + i) slot();
+    }
+    return slots;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+bool concurrent_balanced_tree<T, Compare, Allocator, Balance>::publish(operation op, const value_type& value, value_type* movable)
+{
+    auto& request = claim_slot();
+    request.m_operation = op;
+    request.m_value = &value;
+    request.m_movable = movable;
+    request.m_state.store(pending, std::memory_order_release);
+
+    for (unsigned spins = 0; request.m_state.load(std::memory_order_acquire) != done; ++spins) {
+        if (m_combiner.try_lock()) {
+            std::lock_guard<std::mutex> lock(m_combiner, std::adopt_lock);
+            combine();
+        } else if (spins > 64) {
+            std::this_thread::yield();
+        }
+    }
+    const bool result = request.m_result;
+    std::exception_ptr error = std::move(request.m_error);
+    request.m_error = nullptr;
+    request.m_state.store(idle, std::memory_order_release);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return result;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+typename concurrent_balanced_tree<T, Compare, Allocator, Balance>::slot& concurrent_balanced_tree<T, Compare, Allocator, Balance>::claim_slot()
+{
+    // a thread keeps coming back to the same slot unless another thread
+    // hashed to it is in the middle of an operation
+    auto index = std::hash<std::thread::id>()(std::this_thread::get_id()) % m_slot_count;
+    for (unsigned probes = 0; ; ++probes, index = (index + 1) % m_slot_count) {
+        int expected = idle;
+        if (m_slots[index].m_state.load(std::memory_order_relaxed) == idle &&
+            m_slots[index].m_state.compare_exchange_strong(expected, claimed, std::memory_order_acquire)) {
+            return m_slots[index];
+        }
+        if (probes >= m_slot_count) {
+            std::this_thread::yield();
+            probes = 0;
+        }
+    }
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+template <typename V>
+typename concurrent_balanced_tree<T, Compare, Allocator, Balance>::tree_type::const_iterator concurrent_balanced_tree<T, Compare, Allocator, Balance>::insert(V&& value, typename tree_type::const_iterator hint, bool hinted, bool& inserted)
+{
+    if (!hinted) {
+        auto result = m_tree.insert(std::forward<V>(value));
+        inserted = result.second;
+        return ++result.first;
+    }
+    const auto before = m_tree.size();
+    auto position = m_tree.insert(hint, std::forward<V>(value));
+    inserted = m_tree.size() != before;
+    return ++position;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Balance>
+void concurrent_balanced_tree<T, Compare, Allocator, Balance>::combine()
+{
+    // a few passes pick up what was published while the previous batch was
+    // being applied, without letting one thread combine forever
+    for (int pass = 0; pass < 4; ++pass) {
+        m_batch.clear();
+        for (unsigned i = 0; i < m_slot_count; ++i) {
+            if (m_slots[i].m_state.load(std::memory_order_acquire) == pending) {
+                m_batch.push_back(&m_slots[i]);
+            }
+        }
+        if (m_batch.empty()) {
+            return;
+        }
+        // equal values keep slot order, and sorting must not allocate. A
+        // comparator throwing midway may leave the sorted copy short of some
+        // slots, so the whole batch, as collected, gets the exception
+        m_order.assign(m_batch.begin(), m_batch.end());
+        try {
+            const auto comp = m_tree.value_comp();
+            std::sort(m_order.begin(), m_order.end(), [&comp](const slot* lhs, const slot* rhs) {
+                if (comp(*lhs->m_value, *rhs->m_value)) {
+                    return true;
+                }
+                return !comp(*rhs->m_value, *lhs->m_value) && lhs < rhs;
+            });
+        } catch (...) {
+            for (auto request : m_batch) {
+                request->m_error = std::current_exception();
+                request->m_state.store(done, std::memory_order_release);
+            }
+            continue;
+        }
+
+        // an insert starts from the successor of the previous one, the first
+        // one and any after an erase search from the root
+        auto hint = m_tree.cend();
+        bool hinted = false;
+        for (auto request : m_order) {
+            try {
+                switch (request->m_operation) {
+                case operation::insert:
+                    hint = request->m_movable != nullptr
+                        ? insert(std::move(*request->m_movable), hint, hinted, request->m_result)
+                        : insert(*request->m_value, hint, hinted, request->m_result);
+                    hinted = true;
+                    break;
+                case operation::erase:
+                    request->m_result = m_tree.erase(*request->m_value) != 0;
+                    hinted = false;
+                    break;
+                case operation::contains:
+                    request->m_result = m_tree.find(*request->m_value) != m_tree.end();
+                    break;
+                }
+            } catch (...) {
+                request->m_error = std::current_exception();
+            }
+        }
+        m_size.store(m_tree.size(), std::memory_order_release);
+        for (auto request : m_order) {
+            request->m_state.store(done, std::memory_order_release);
+        }
+    }
+}
+
+} // namespace std
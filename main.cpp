@@ -1,9 +1,18 @@
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <string>
 #include <vector>
 #include <cassert>
+#include <set>
 
 #include "balanced_tree.h"
+#include "balanced_map.h"
+#include "balanced_multiset.h"
+#include "balanced_tree_parallel.h"
+#include "concurrent_balanced_tree.h"
 #include "unit_test.h"
 
 int main()
@@ -15,5 +24,25 @@ int main()
     move_constructor();
     move_assignement();
     clear();
+    stateful_comparator();
+#if __cplusplus >= 201703L
+    pmr_monotonic_arena();
+    pmr_failed_move();
+#endif
+    balancing_policies();
+    balanced_map_operations();
+    balanced_multiset_operations();
+    hinted_insert();
+    range_insert();
+    lazy_erase();
+    string_prefix_keys();
+    three_way_search();
+    parallel_copy_and_clear();
+    range_aggregates();
+    relayout_orders();
+    partition_sizes();
+    parallel_algorithms();
+    concurrent_writers();
+    concurrent_errors();
 }
 
@@ -11,8 +11,8 @@ if ((x)) {\
     std::cout << "FAILED  " << __FUNCTION__ << std::endl;\
 }
 
-template <typename T>
-void initailize(std::balanced_tree<T>& tree)
+template <typename T, typename A>
+void initailize(std::balanced_tree<T, std::less<T>, A>& tree)
 {
     for (int i = 0; i < SIZE; ++i) {
         tree.insert(i);
@@ -93,3 +93,767 @@ void clear()
     TEST(tree.size() == 0 && tree.empty());
 }
 
+
+namespace test {
+
+struct modulo_less
+{
+    explicit modulo_less(int modulo = 10)
+        : m_modulo(modulo)
+    {}
+
+    bool operator() (int lhs, int rhs) const
+    {
+        return lhs % m_modulo < rhs % m_modulo;
+    }
+
+    int m_modulo;
+};
+
+/*
+ * @brief counts its calls, with Compare3 it also offers the three-way form
+ */
+template <bool Compare3>
+struct counting_less
+{
+    explicit counting_less(size_t* calls = nullptr)
+        : m_calls(calls)
+    {}
+
+    bool operator() (int lhs, int rhs) const
+    {
+        ++*m_calls;
+        return lhs < rhs;
+    }
+
+    template <bool Enable = Compare3, typename = typename std::enable_if<Enable>::type>
+    int compare(int lhs, int rhs) const
+    {
+        ++*m_calls;
+        return lhs < rhs ? -1 : (rhs < lhs ? 1 : 0);
+    }
+
+    size_t* m_calls;
+};
+
+/*
+ * @brief returns the largest number of comparator calls spent by a lookup or
+ *        a duplicate insert, the tree holds 0 ... SIZE - 1
+ */
+template <bool Compare3>
+size_t comparisons_per_lookup()
+{
+    size_t calls = 0;
+    std::balanced_tree<int, counting_less<Compare3> > tree{counting_less<Compare3>(&calls)};
+    for (int i = 0; i < SIZE; ++i) {
+        tree.insert((i * 7919) % SIZE);
+    }
+    size_t most = 0;
+    for (int i = -1; i <= SIZE; ++i) {
+        calls = 0;
+        tree.find(i);
+        tree.insert(std::min(std::max(i, 0), SIZE - 1));
+        most = std::max(most, calls);
+    }
+    return most;
+}
+
+} //namespace test
+
+void stateful_comparator()
+{
+    std::balanced_tree<int, test::modulo_less> by_ten(test::modulo_less(10));
+    std::balanced_tree<int, test::modulo_less> by_three(test::modulo_less(3));
+    for (int i = 0; i < 20; ++i) {
+        by_ten.insert(i);
+        by_three.insert(i);
+    }
+
+    std::balanced_tree<int, test::modulo_less> copy(by_three);
+    assert(copy.size() == 3);
+    copy.swap(by_ten);
+
+    TEST(by_ten.size() == 3 && copy.size() == 10 &&
+         copy.value_comp().m_modulo == 10 &&
+         sizeof(std::balanced_tree<int>) < sizeof(std::balanced_tree<int, test::modulo_less>));
+}
+
+#if __cplusplus >= 201703L
+void pmr_monotonic_arena()
+{
+    static char buffer[1 << 18];
+    std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer),
+                                              std::pmr::null_memory_resource());
+    {
+        std::pmr::balanced_tree<int> tree(&arena);
+        test::initailize(tree);
+        std::pmr::balanced_tree<int> copy(tree, &arena);
+        assert(copy.get_allocator().resource() == &arena);
+
+        std::pmr::balanced_tree<int> moved(std::move(copy));
+        TEST(moved.size() == test::SIZE &&
+             std::equal(moved.begin(), moved.end(), tree.begin()));
+    }
+}
+
+namespace test {
+
+/*
+ * @brief heap resource that runs out after a given number of allocations
+ */
+class failing_resource
+    : public std::pmr::memory_resource
+{
+public:
+    explicit failing_resource(int allocations)
+        : m_allocations(allocations)
+    {}
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+        if (m_allocations-- <= 0) {
+            throw std::bad_alloc();
+        }
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override
+    {
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& that) const noexcept override
+    {
+        return this == &that;
+    }
+
+private:
+    int m_allocations;
+};
+
+} //namespace test
+
+void pmr_failed_move()
+{
+    // moving between resources copies node by node, running out halfway
+    // must free the partial copy and leave the target empty
+    std::pmr::balanced_tree<int> source;
+    test::initailize(source);
+    test::failing_resource constructed_from(50);
+    bool construct_thrown = false;
+    try {
+        std::pmr::balanced_tree<int> moved(std::move(source), &constructed_from);
+    } catch (const std::bad_alloc&) {
+        construct_thrown = true;
+    }
+
+    test::failing_resource assigned_from(50);
+    std::pmr::balanced_tree<int> assigned(&assigned_from);
+    bool assign_thrown = false;
+    try {
+        assigned = std::move(source);
+    } catch (const std::bad_alloc&) {
+        assign_thrown = true;
+    }
+    TEST(construct_thrown && assign_thrown && assigned.empty() &&
+         assigned.begin() == assigned.end() && source.size() == test::SIZE);
+}
+#endif
+
+namespace test {
+
+template <typename Balance>
+bool balanced_tree_matches_set()
+{
+    std::balanced_tree<int, std::less<int>, std::allocator<int>, Balance> tree;
+    std::set<int> reference;
+    for (int i = 0; i < 20 * SIZE; ++i) {
+        const int value = (i * 7919) % (2 * SIZE);
+        if (i % 3 == 2) {
+            if (tree.erase(value) != reference.erase(value)) {
+                return false;
+            }
+        } else if (tree.insert(value).second != reference.insert(value).second) {
+            return false;
+        }
+    }
+    return tree.size() == reference.size() &&
+           std::equal(tree.begin(), tree.end(), reference.begin());
+}
+
+} //namespace test
+
+void balancing_policies()
+{
+    TEST(test::balanced_tree_matches_set<std::avl_balance>() &&
+         test::balanced_tree_matches_set<std::red_black_balance>() &&
+         test::balanced_tree_matches_set<std::weight_balance>());
+}
+
+namespace test {
+
+template <bool InlineKeys>
+bool balanced_map_operations()
+{
+    std::balanced_map<std::string, int, std::less<std::string>,
+                      std::allocator<std::pair<const std::string, int> >,
+                      std::avl_balance, InlineKeys> map;
+    for (int i = 0; i < SIZE; ++i) {
+        map[std::to_string(i)] += i;
+    }
+    assert(map.size() == SIZE);
+
+    bool thrown = false;
+    try {
+        map.at("missing");
+    } catch (const std::out_of_range&) {
+        thrown = true;
+    }
+
+    std::string key = "7";
+    const bool emplaced = map.try_emplace(std::move(key), -1).second;
+    const bool assigned = !map.insert_or_assign("7", 70).second;
+    const bool inserted = map.insert_or_assign("new", 1).second;
+
+    // pairs with a const key are never assigned by the batch insert, the
+    // first of equal keys is kept
+    std::balanced_map<int, std::string, std::less<int>, std::allocator<std::pair<const int, std::string> >,
+                      std::avl_balance, InlineKeys> listed = {{2, "b"}, {1, "a"}, {2, "x"}};
+    listed.insert({{3, "c"}, {1, "y"}});
+    const bool batched = listed.size() == 3 && listed.at(1) == "a" && listed.at(2) == "b" && listed.at(3) == "c";
+
+    return thrown && !emplaced && key == "7" && assigned && inserted && batched &&
+           map.at("7") == 70 && map["42"] == 42 && map.erase("new") == 1 &&
+           map.count("new") == 0 && map.begin()->first == "0";
+}
+
+} //namespace test
+
+void balanced_map_operations()
+{
+    TEST(test::balanced_map_operations<false>() &&
+         test::balanced_map_operations<true>());
+}
+
+namespace test {
+
+template <bool Compressed>
+bool balanced_multiset_operations()
+{
+    std::balanced_multiset<int, std::less<int>, std::allocator<int>,
+                           std::avl_balance, Compressed> multiset;
+    std::multiset<int> reference;
+    for (int i = 0; i < SIZE; ++i) {
+        multiset.insert(i % 10);
+        reference.insert(i % 10);
+    }
+    multiset.insert({3, 3});
+    reference.insert({3, 3});
+    assert(multiset.size() == reference.size());
+
+    const bool counted = multiset.count(3) == 102 && multiset.count(42) == 0;
+    const auto range = multiset.equal_range(5);
+    const bool ranged = std::distance(range.first, range.second) == 100 && *range.first == 5;
+
+    multiset.erase_one(3);
+    reference.erase(reference.find(3));
+    multiset.erase(multiset.find(4));
+    reference.erase(reference.find(4));
+    const bool erased_all = multiset.erase(7) == 100;
+    reference.erase(7);
+
+    // copies keep the count of every value
+    auto copy = multiset;
+    decltype(multiset) assigned;
+    assigned.insert(42);
+    assigned = multiset;
+    const bool copied = copy.count(3) == 101 && assigned.count(3) == 101 && assigned.count(42) == 0 &&
+                        copy.size() == reference.size() && assigned.size() == reference.size() &&
+                        std::equal(assigned.begin(), assigned.end(), reference.begin());
+
+    return counted && ranged && erased_all && copied && multiset.size() == reference.size() &&
+           std::equal(multiset.begin(), multiset.end(), reference.begin());
+}
+
+} //namespace test
+
+void balanced_multiset_operations()
+{
+    std::balanced_multiset<int, std::less<int>, std::allocator<int>, std::avl_balance, true> compressed;
+    for (int i = 0; i < test::SIZE; ++i) {
+        compressed.insert(i % 10);
+    }
+
+    TEST(test::balanced_multiset_operations<false>() &&
+         test::balanced_multiset_operations<true>() &&
+         compressed.distinct_size() == 10);
+}
+
+void hinted_insert()
+{
+    std::balanced_tree<int> tree;
+    for (int i = 0; i < test::SIZE; i += 2) {
+        tree.insert(tree.end(), i);
+    }
+    auto hint = tree.find(test::SIZE / 2);
+    for (int i = 1; i < test::SIZE; i += 2) {
+        hint = tree.insert(hint, i);
+    }
+    const bool duplicate = *tree.insert(tree.begin(), 10) == 10;
+
+    std::balanced_map<int, int> map;
+    for (int i = 0; i < test::SIZE; ++i) {
+        map.try_emplace(map.end(), i, i);
+    }
+
+    // keys mostly ascending with every eighth one late, the previous position
+    // as hint costs no more comparisons than no hint
+    size_t hinted_calls = 0;
+    size_t plain_calls = 0;
+    std::balanced_tree<int, test::counting_less<false> > hinted{test::counting_less<false>(&hinted_calls)};
+    std::balanced_tree<int, test::counting_less<false> > plain{test::counting_less<false>(&plain_calls)};
+    auto last = hinted.end();
+    for (int i = 0; i < test::SIZE; ++i) {
+        const int key = i % 8 == 7 ? 10 * i - 45 : 10 * i;
+        last = hinted.insert(last, key);
+        plain.insert(key);
+    }
+
+    TEST(duplicate && tree.size() == test::SIZE && *tree.rbegin() == test::SIZE - 1 &&
+         std::is_sorted(tree.begin(), tree.end()) && map.size() == test::SIZE &&
+         hinted.size() == plain.size() && hinted_calls <= plain_calls);
+}
+
+void range_insert()
+{
+    std::balanced_tree<int> tree;
+    std::set<int> reference;
+    test::initailize(tree);
+    for (int i = 0; i < test::SIZE; ++i) {
+        reference.insert(i);
+    }
+
+    std::vector<int> small = {5, 2 * test::SIZE, -1, 2 * test::SIZE};
+    tree.insert(small.begin(), small.end());
+    reference.insert(small.begin(), small.end());
+
+    std::vector<int> large(100 * test::SIZE);
+    for (size_t i = 0; i < large.size(); ++i) {
+        large[i] = static_cast<int>((i * 7919) % (60 * test::SIZE));
+    }
+    tree.insert(large.begin(), large.end());
+    reference.insert(large.begin(), large.end());
+
+    TEST(tree.size() == reference.size() &&
+         std::equal(tree.begin(), tree.end(), reference.begin()) &&
+         *tree.rbegin() == *reference.rbegin());
+}
+
+void lazy_erase()
+{
+    std::balanced_tree<int> tree;
+    test::initailize(tree);
+    tree.set_lazy_erase(true, 0.9);
+
+    for (int i = 0; i < test::SIZE; i += 2) {
+        tree.erase(i);
+    }
+    assert(tree.size() == test::SIZE / 2 && tree.tombstones() == test::SIZE / 2);
+    const bool skipped = *tree.begin() == 1 && tree.find(0) == tree.end() &&
+                         *tree.lower_bound(2) == 3 && *tree.rbegin() == test::SIZE - 1;
+
+    const bool revived = tree.insert(10).second && tree.tombstones() == test::SIZE / 2 - 1;
+    tree.compact();
+
+    std::vector<int> expected;
+    for (int i = 1; i < test::SIZE; i += 2) {
+        expected.push_back(i);
+    }
+    expected.insert(expected.begin() + 5, 10);
+
+    TEST(skipped && revived && tree.tombstones() == 0 &&
+         tree.size() == expected.size() &&
+         std::equal(tree.begin(), tree.end(), expected.begin()));
+}
+
+void string_prefix_keys()
+{
+    // long shared prefixes, strings shorter than the prefix, embedded zero
+    // bytes and bytes above 0x7f all have to order like std::string
+    std::vector<std::string> keys = {"", "a", "ab", std::string("ab\0", 3), "abc",
+                                     "\x80", "\xff\xff", "zzzzzzzz", "zzzzzzzza"};
+    for (int i = 0; i < test::SIZE; ++i) {
+        keys.push_back("https://example.com/item/" + std::to_string(i * 37 % test::SIZE));
+        keys.push_back("id" + std::to_string(i));
+    }
+    std::balanced_tree<std::string> tree;
+    std::set<std::string> reference;
+    for (const auto& key : keys) {
+        tree.insert(key);
+        reference.insert(key);
+    }
+
+    bool found = true;
+    for (const auto& key : reference) {
+        found = found && tree.find(key) != tree.end() && *tree.find(key) == key;
+    }
+    const bool bounds = *tree.lower_bound("ab") == "ab" &&
+                        *tree.upper_bound("ab") == std::string("ab\0", 3) &&
+                        tree.find("https://example.com/item/") == tree.end();
+
+    TEST(found && bounds && tree.size() == reference.size() &&
+         std::equal(tree.begin(), tree.end(), reference.begin()));
+}
+
+void three_way_search()
+{
+    // an AVL tree of 1000 elements is at most 13 levels deep; a find and an
+    // insert of a present key cost one comparison per level, one more for
+    // the append check of insert and, without a three-way form, one more each
+    // for the equality check
+    const size_t height = 13;
+    TEST(test::comparisons_per_lookup<true>() <= 2 * height + 1 &&
+         test::comparisons_per_lookup<false>() <= 2 * height + 3);
+}
+
+void parallel_copy_and_clear()
+{
+    // large enough to split the copy and the teardown onto threads
+    std::vector<int> values(1 << 17);
+    for (size_t i = 0; i < values.size(); ++i) {
+        values[i] = static_cast<int>(i);
+    }
+    std::balanced_tree<int> tree(values.begin(), values.end());
+    std::balanced_tree<int> copy(tree);
+    const bool copied = copy.size() == values.size() &&
+                        std::equal(copy.begin(), copy.end(), values.begin()) &&
+                        *copy.rbegin() == values.back();
+
+    tree.clear_async();
+    const bool emptied = tree.empty() && tree.begin() == tree.end();
+    tree.insert(1);
+    copy.erase(5);
+    copy.insert(-1);
+    copy.clear();
+
+    TEST(copied && emptied && tree.size() == 1 && *tree.begin() == 1 && copy.empty());
+}
+
+namespace test {
+
+struct sum_augment
+{
+    typedef long summary_type;
+
+    static long identity()
+    {
+        return 0;
+    }
+
+    static long make(int value)
+    {
+        return value;
+    }
+
+    static long combine(long lhs, long rhs)
+    {
+        return lhs + rhs;
+    }
+};
+
+typedef std::pair<int, int> interval;
+
+/*
+ * @brief summarises intervals ordered by their start with the largest end
+ */
+struct max_end_augment
+{
+    typedef int summary_type;
+
+    static int identity()
+    {
+        return std::numeric_limits<int>::min();
+    }
+
+    static int make(const interval& value)
+    {
+        return value.second;
+    }
+
+    static int combine(int lhs, int rhs)
+    {
+        return std::max(lhs, rhs);
+    }
+};
+
+} //namespace test
+
+void range_aggregates()
+{
+    std::balanced_tree<int, std::less<int>, std::allocator<int>, std::red_black_balance, test::sum_augment> sums;
+    for (int i = 0; i < test::SIZE; ++i) {
+        sums.insert(i);
+    }
+    for (int i = 0; i < test::SIZE; i += 3) {
+        sums.erase(i);
+    }
+    long expected = 0;
+    for (int i = 100; i <= 200; ++i) {
+        expected += i % 3 != 0 ? i : 0;
+    }
+    const bool summed = sums.aggregate(100, 200) == expected && sums.aggregate(5, 4) == 0 &&
+                        sums.aggregate() == sums.aggregate(-1, test::SIZE);
+
+    std::balanced_tree<test::interval, std::less<test::interval>, std::allocator<test::interval>,
+                       std::avl_balance, test::max_end_augment> intervals;
+    std::vector<test::interval> all;
+    for (int i = 0; i < test::SIZE; ++i) {
+        const int start = (i * 7919) % (10 * test::SIZE);
+        all.emplace_back(start, start + (i * 31) % 200);
+        intervals.insert(all.back());
+    }
+    std::sort(all.begin(), all.end());
+    const int from = 4000;
+    const int to = 4100;
+    std::vector<test::interval> overlapping;
+    intervals.visit_pruned([from](int max_end) {
+        return max_end >= from;
+    }, [to, &overlapping](const test::interval& value) {
+        if (value.first > to) {
+            return false;
+        }
+        if (value.second >= from) {
+            overlapping.push_back(value);
+        }
+        return true;
+    });
+    std::vector<test::interval> expected_overlapping;
+    std::copy_if(all.begin(), all.end(), std::back_inserter(expected_overlapping), [from, to](const test::interval& value) {
+        return value.first <= to && value.second >= from;
+    });
+
+    TEST(summed && !overlapping.empty() && overlapping == expected_overlapping);
+}
+
+void relayout_orders()
+{
+    std::balanced_tree<std::string> tree;
+    std::set<std::string> reference;
+    tree.set_lazy_erase(true, 0.9);
+    for (int i = 0; i < test::SIZE; ++i) {
+        const auto key = std::to_string((i * 7919) % test::SIZE);
+        tree.insert(key);
+        reference.insert(key);
+    }
+
+    bool kept = true;
+    const std::balanced_tree_layout orders[] = {std::balanced_tree_layout::in_order,
+                                                std::balanced_tree_layout::breadth_first,
+                                                std::balanced_tree_layout::van_emde_boas};
+    for (int round = 0; round < 6; ++round) {
+        // erased nodes stay as tombstones, half of them inside the last slab
+        for (int i = round; i < test::SIZE; i += 7) {
+            tree.erase(std::to_string(i));
+            reference.erase(std::to_string(i));
+        }
+        tree.insert(std::to_string(round));
+        reference.insert(std::to_string(round));
+        tree.relayout(orders[round % 3], round == 5);
+
+        kept = kept && tree.size() == reference.size() &&
+               std::equal(tree.begin(), tree.end(), reference.begin()) &&
+               std::equal(tree.rbegin(), tree.rend(), reference.rbegin()) &&
+               (tree.find("500") != tree.end()) == (reference.count("500") != 0);
+    }
+    std::balanced_tree<std::string> copy(tree);
+    tree.set_lazy_erase(false);
+    tree.insert("new");
+
+    TEST(kept && copy.size() == reference.size() && tree.size() == reference.size() + 1 &&
+         *tree.rbegin() == "new");
+}
+
+namespace test {
+
+/*
+ * @brief returns true when the runs of partition(pieces) cover the tree in
+ *        order without gaps or overlaps, longest gets the longest run
+ */
+template <typename Tree>
+bool partition_covers(const Tree& tree, size_t pieces, size_t& longest)
+{
+    std::vector<typename std::decay<decltype(*tree.begin())>::type> joined;
+    longest = 0;
+    for (const auto& range : tree.partition(pieces)) {
+        const auto before = joined.size();
+        joined.insert(joined.end(), range.begin(), range.end());
+        longest = std::max(longest, joined.size() - before);
+    }
+    return joined.size() == tree.size() && std::equal(joined.begin(), joined.end(), tree.begin());
+}
+
+} //namespace test
+
+void partition_sizes()
+{
+    // trees grown in scattered order, red-black sizes are estimated from the
+    // heights while the counting AVL tree knows them exactly
+    const int size = 1 << 16;
+    std::balanced_tree<int, std::less<int>, std::allocator<int>, std::red_black_balance> estimated;
+    std::balanced_tree<int, std::less<int>, std::allocator<int>, std::avl_balance, std::size_augment> counted;
+    for (int i = 0; i < size; ++i) {
+        estimated.insert(i * 7919 % size);
+        counted.insert(i * 7919 % size);
+    }
+    for (int i = 0; i < size; i += 3) {
+        counted.erase(i);
+    }
+
+    bool covered = true;
+    bool even = true;
+    for (size_t pieces : {1, 3, 8, 13, 64}) {
+        size_t longest = 0;
+        covered = covered && test::partition_covers(estimated, pieces, longest);
+        covered = covered && test::partition_covers(counted, pieces, longest);
+        even = even && longest * pieces <= counted.size() * 5 / 4;
+    }
+    TEST(covered && even);
+}
+
+void parallel_algorithms()
+{
+    std::vector<int> values(1 << 16);
+    for (size_t i = 0; i < values.size(); ++i) {
+        values[i] = static_cast<int>(i);
+    }
+    std::balanced_tree<int, std::less<int>, std::allocator<int>, std::weight_balance> tree(values.begin(), values.end());
+    for (int i = 0; i < 1000; i += 2) {
+        tree.erase(i);
+    }
+
+    // the runs cover the tree in order, without gaps or overlaps
+    std::vector<int> joined;
+    for (const auto& range : tree.partition(7)) {
+        joined.insert(joined.end(), range.begin(), range.end());
+    }
+    const bool covered = joined.size() == tree.size() && std::equal(joined.begin(), joined.end(), tree.begin());
+
+    std::atomic<long> visited(0);
+    std::parallel_for_each(tree, [&visited](int value) {
+        visited += value;
+    });
+    const long sum = std::parallel_reduce(tree, 0L, std::plus<long>(), [](int value) {
+        return static_cast<long>(value);
+    });
+    const auto odd = std::parallel_count_if(tree.partition(100, 199, 4), [](int value) {
+        return value % 2 != 0;
+    });
+    const auto first = std::parallel_reduce(tree.partition(3), std::string(), std::plus<std::string>(), [](int value) {
+        return value < 6 ? std::to_string(value) : std::string();
+    });
+
+    long expected = 0;
+    for (const auto value : tree) {
+        expected += value;
+    }
+    TEST(covered && visited == expected && sum == expected && odd == 50 && first == "135");
+}
+
+void concurrent_writers()
+{
+    // every thread inserts its own keys and all of the shared ones, then
+    // erases its own odd keys
+    const int threads = 4;
+    const int own = 2000;
+    const int shared = 100;
+    std::concurrent_balanced_tree<int> tree;
+    std::atomic<int> shared_inserted(0);
+    std::atomic<int> erased(0);
+    std::atomic<int> missing(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            for (int i = 0; i < own; ++i) {
+                tree.insert(shared + i * threads + t);
+                shared_inserted += tree.insert(i % shared) ? 1 : 0;
+            }
+            for (int i = 1; i < own; i += 2) {
+                erased += static_cast<int>(tree.erase(shared + i * threads + t));
+                missing += tree.contains(shared + i * threads + t) ? 1 : 0;
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    bool ordered = false;
+    tree.visit([&ordered, threads, own, shared](const std::balanced_tree<int>& contents) {
+        int expected = 0;
+        ordered = true;
+        for (const auto value : contents) {
+            ordered = ordered && value == expected;
+            ++expected;
+            while (expected >= shared && (expected - shared) / threads % 2 != 0) {
+                ++expected;
+            }
+        }
+        ordered = ordered && expected >= shared + own * threads - threads;
+    });
+    TEST(ordered && shared_inserted == shared && erased == threads * own / 2 && missing == 0 &&
+         tree.size() == static_cast<size_t>(shared + threads * own / 2));
+}
+
+namespace test {
+
+/*
+ * @brief orders non-negative ints, throws when asked about a negative one
+ */
+struct throwing_less
+{
+    bool operator() (int lhs, int rhs) const
+    {
+        if (lhs < 0 || rhs < 0) {
+            throw std::domain_error("negative");
+        }
+        return lhs < rhs;
+    }
+};
+
+} //namespace test
+
+void concurrent_errors()
+{
+    // negative values make the comparator throw, whether while sorting a
+    // batch or while applying it, and every publisher of one must get the
+    // exception back; others may share the fate of a batch that failed to sort
+    const int threads = 4;
+    const int rounds = 500;
+    std::concurrent_balanced_tree<int, test::throwing_less> tree;
+    // inserting into an empty tree compares nothing
+    tree.insert(threads * rounds);
+    std::atomic<int> unreported(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            for (int i = 0; i < rounds; ++i) {
+                const int value = i % 10 == 0 ? -1 : i * threads + t;
+                try {
+                    tree.insert(value);
+                    unreported += value < 0 ? 1 : 0;
+                } catch (const std::domain_error&) {
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    bool valid = true;
+    tree.visit([&valid](const std::balanced_tree<int, test::throwing_less>& contents) {
+        valid = !contents.empty() && std::is_sorted(contents.begin(), contents.end()) && *contents.begin() >= 0;
+    });
+    TEST(unreported == 0 && valid);
+}